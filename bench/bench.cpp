@@ -0,0 +1,255 @@
+// Benchmark harness for the interpreter. Generates a set of workloads into a
+// temporary directory, runs the interpreter on each of them several times
+// and prints one JSON object per workload, so results from two builds can be
+// diffed or fed into a tracker.
+//
+//   bin/bench [--runs N] [--scale F] [--only NAME] [--label TEXT] [interpreter]
+//
+// Run from the repository root: workloads import examples/std.soq. Rewrite
+// counts are known from how each workload is generated, latency
+// percentiles are taken over runs, and peak RSS is the largest maximum
+// resident set of any run. POSIX only.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+typedef struct Workload_Size {
+    uint64_t statements;
+    uint64_t rewrites;
+} Workload_Size;
+
+typedef struct Workload {
+    std::string name;
+    Workload_Size (*generate)(std::ostream&, double scale);
+} Workload;
+
+typedef struct Run {
+    double wall_ms;
+    long peak_rss_kb;
+    int status;
+} Run;
+
+// Deterministic so every build sees the same workloads; reset before each
+// workload so --only generates the same file as a full run.
+const uint64_t LCG_SEED = 88172645463325252ULL;
+uint64_t lcg_state = LCG_SEED;
+uint64_t next_random(uint64_t bound) {
+    lcg_state = lcg_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (lcg_state >> 33) % bound;
+}
+
+void write_num(std::ostream& out, uint64_t n) {
+    for (uint64_t i = 0; i < n; ++i) out << "s(";
+    out << "0";
+    for (uint64_t i = 0; i < n; ++i) out << ")";
+}
+
+size_t scaled(size_t n, double scale) {
+    return std::max((size_t)1, (size_t)(n * scale));
+}
+
+// Many small sums through the @add macro. add(s^a(0), b) takes a steps of
+// `add` and one of `add0`.
+Workload_Size peano_sums(std::ostream& out, double scale) {
+    Workload_Size size = {0, 0};
+    out << "import \"examples/std.soq\"\n";
+    for (size_t i = 0, n = scaled(2000, scale); i < n; ++i) {
+        uint64_t a = next_random(200), b = next_random(200);
+        out << "_ := add(";
+        write_num(out, a);
+        out << ", ";
+        write_num(out, b);
+        out << ") @add $dump\n";
+        size.statements += 1;
+        size.rewrites += a + 1;
+    }
+    return size;
+}
+
+// A few very deep s(...) chains; exercises deep parsing and Num nodes.
+Workload_Size deep_succ(std::ostream& out, double scale) {
+    Workload_Size size = {0, 0};
+    out << "import \"examples/std.soq\"\n";
+    for (size_t i = 0; i < 3; ++i) {
+        uint64_t depth = scaled(100000, scale);
+        out << "_ := add(";
+        write_num(out, depth);
+        out << ", s(0)) @add $dump\n";
+        size.statements += 1;
+        size.rewrites += depth + 1;
+    }
+    return size;
+}
+
+// Balanced pair trees with a sum at every leaf, normalized with `? | all`.
+// Leaves repeat, so the trees are shared DAGs in the store.
+Workload_Size wide_pairs(std::ostream& out, double scale) {
+    Workload_Size size = {0, 0};
+    out << "import \"examples/std.soq\"\n";
+    size_t depth = 1;
+    while (((size_t)1 << (depth + 1)) <= scaled(16384, scale)) ++depth;
+    for (size_t tree = 0; tree < 4; ++tree) {
+        out << "_ := ";
+        for (size_t leaf = 0; leaf < ((size_t)1 << depth); ++leaf) {
+            for (size_t level = 0; level < depth && (leaf >> level & 1) == 0; ++level)
+                out << "pair(";
+            uint64_t a = next_random(8), b = next_random(8);
+            out << "add(";
+            write_num(out, a);
+            out << ", ";
+            write_num(out, b);
+            out << ")";
+            size.rewrites += a + 1;
+            size_t level = 0;
+            for (; level < depth && (leaf >> level & 1) == 1; ++level) out << ")";
+            if (level < depth) out << ", ";
+        }
+        out << " {? | all} void\n";
+        size.statements += 1;
+    }
+    return size;
+}
+
+// A large rulebook where each statement fires one rule three times through
+// the `?` index.
+Workload_Size big_rulebook(std::ostream& out, double scale) {
+    Workload_Size size = {0, 0};
+    size_t rules = scaled(5000, scale);
+    for (size_t i = 0; i < rules; ++i) {
+        out << "r" << i << " := f" << i << "(x, s(y)) = f" << i << "(g(x), y)\n";
+        size.statements += 1;
+    }
+    for (size_t i = 0; i < rules; ++i) {
+        out << "_ := f" << next_random(rules) << "(a, s(s(s(0)))) {? | all} void\n";
+        size.statements += 1;
+        size.rewrites += 3;
+    }
+    return size;
+}
+
+// Several megabytes of rules, macros, comments and multi-line shapes, for
+// the lexer and parser; nothing is rewritten.
+Workload_Size large_source(std::ostream& out, double scale) {
+    Workload_Size size = {0, 0};
+    for (size_t i = 0, n = scaled(100000, scale); i < n; ++i) {
+        out << "# rule " << i << "\n";
+        out << "p" << i << " := h" << i << "(x, pair(y, z)) = h" << i << "(pair(z, y), x)\n";
+        out << "@m" << i << " := k(" << i << ")\n";
+        out << "_ := pair(a" << i << ", @m" << i << ") {\n    p" << i << " | all; # inline\n} void\n";
+        size.statements += 3;
+    }
+    return size;
+}
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+Run run_interpreter(const std::string interpreter, const std::string source) {
+    Run run = {0, 0, -1};
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execl(interpreter.c_str(), interpreter.c_str(), source.c_str(), (char*)NULL);
+        _exit(127);
+    }
+    struct rusage usage;
+    int status;
+    if (pid < 0 || wait4(pid, &status, 0, &usage) < 0) return run;
+    run.wall_ms = now_ms() - start;
+    run.peak_rss_kb = usage.ru_maxrss;
+    run.status = WIFEXITED(status)? WEXITSTATUS(status): 128 + WTERMSIG(status);
+    return run;
+}
+
+double percentile(std::vector<double> values, double p) {
+    std::sort(values.begin(), values.end());
+    size_t rank = (size_t)(p / 100.0 * (values.size() - 1) + 0.5);
+    return values[std::min(rank, values.size() - 1)];
+}
+
+std::string json_string(const std::string str) {
+    std::string out = "\"";
+    for (char ch: str) {
+        if (ch == '"' || ch == '\\') out.push_back('\\');
+        out.push_back(ch);
+    }
+    return out + "\"";
+}
+
+int main(int argc, char* argv[]) {
+    std::string interpreter = "./bin/interpreter", only = "", label = "";
+    size_t runs = 5;
+    double scale = 1.0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--runs" && i+1 < argc) runs = std::max(1, atoi(argv[++i]));
+        else if (arg == "--scale" && i+1 < argc) scale = atof(argv[++i]);
+        else if (arg == "--only" && i+1 < argc) only = argv[++i];
+        else if (arg == "--label" && i+1 < argc) label = argv[++i];
+        else interpreter = arg;
+    }
+    char dir[] = "/tmp/sock-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        std::cerr << "BENCH ERROR:: Could not create a temporary directory" << std::endl;
+        return 1;
+    }
+    const std::vector<Workload> workloads = {
+        {"peano_sums", peano_sums},
+        {"deep_succ", deep_succ},
+        {"wide_pairs", wide_pairs},
+        {"big_rulebook", big_rulebook},
+        {"large_source", large_source},
+    };
+    int failed = 0;
+    for (const Workload& workload: workloads) {
+        if (!only.empty() && workload.name != only) continue;
+        std::string source = std::string(dir) + "/" + workload.name + ".soq";
+        std::ofstream out(source);
+        lcg_state = LCG_SEED;
+        Workload_Size size = workload.generate(out, scale);
+        out.close();
+        long bytes = std::ifstream(source, std::ios::binary | std::ios::ate).tellg();
+
+        std::vector<double> wall;
+        long peak_rss_kb = 0;
+        int status = 0;
+        for (size_t i = 0; i < runs && status == 0; ++i) {
+            Run run = run_interpreter(interpreter, source);
+            wall.push_back(run.wall_ms);
+            peak_rss_kb = std::max(peak_rss_kb, run.peak_rss_kb);
+            status = run.status;
+        }
+        remove(source.c_str());
+        double median_s = percentile(wall, 50) / 1e3;
+        printf("{\"bench\": %s, \"label\": %s, \"status\": %d, \"runs\": %zu, ",
+            json_string(workload.name).c_str(), json_string(label).c_str(), status, wall.size());
+        printf("\"bytes\": %ld, \"statements\": %llu, \"rewrites\": %llu, ",
+            bytes, (unsigned long long)size.statements, (unsigned long long)size.rewrites);
+        printf("\"wall_ms\": {\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}, ",
+            percentile(wall, 0), percentile(wall, 50), percentile(wall, 90), percentile(wall, 99), percentile(wall, 100));
+        printf("\"statements_per_sec\": %.1f, \"rewrites_per_sec\": %.1f, \"peak_rss_kb\": %ld}\n",
+            size.statements / median_s, size.rewrites / median_s, peak_rss_kb);
+        fflush(stdout);
+        if (status != 0) failed = 1;
+    }
+    rmdir(dir);
+    return failed;
+}
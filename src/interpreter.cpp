@@ -3,23 +3,47 @@
 #include <string.h>
 #include <iostream> 
 #include <fstream>
+#include <sstream>
 #include <cwctype> 
 #include <vector>
 #include <stack>
 #include <algorithm>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <filesystem>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+#include "sock.h"
 #include "sock_enr.cpp"
+#include "sock_soqc.cpp"
+#include "sock_nfc.cpp"
+#include "sock_emit.cpp"
 
 typedef enum {
     WALRUS, EQUAL, TEXT, OPEN_CB, CLOSE_CB, PIPE, AT,
     MOD, EXPR_MOD, KEYWORD, QUOTE, SEMI_COLON, ANY,
 } Token_Type;
 
+// Tokens normally view the source text directly; only text synthesized
+// by merge_text is owned by the token itself.
 typedef struct Token {
     Token_Type type;
-    std::string str; 
+    std::string_view view;
+    std::string owned;
 public:
+    std::string_view str() const;
     void print() const;   
 } Token;
 
@@ -35,23 +59,127 @@ public:
 #define SHAPE_SYNTAX {TEXT, WALRUS, TEXT, OPEN_CB, ANY, CLOSE_CB, MOD}
 #define IMPORT_SYNTAX {KEYWORD, QUOTE, TEXT, QUOTE}
 #define MACRO_SYNTAX {AT, TEXT, WALRUS, ANY}
+#define THEORY_SYNTAX {KEYWORD, QUOTE, TEXT, QUOTE}
+
+// A macro body is lexed once, when it is defined. Its expansion, with
+// nested macros spliced in, is built on first use and is stale once any
+// macro is (re)defined after it, so references still bind late.
+typedef struct Macro {
+    std::string text;               // tokens view into this
+    std::vector<Token> tokens;
+    std::vector<Token> expanded;
+    std::vector<std::string> uses;  // every macro the expansion pulled in
+    uint64_t generation;            // macro_generation `expanded` was built in
+    bool expanding;
+} Macro;
+
+typedef struct Shape_Step {
+    std::string rulename;
+    const Rule* rule;       // NULL for `?`
+    std::string mod;
+} Shape_Step;
+
+// Something a statement read, for --watch: the fingerprint of a rule
+// ('r'), of the whole rule order ('?'), of the declared theories ('t'), a
+// named expression ('e') or the hash of a macro's text ('m'). Entries that
+// do not exist read as 0.
+typedef struct Watch_Read {
+    std::string key;
+    uint64_t value;
+    Expr expr;      // the expression an 'e' read found
+} Watch_Read;
+
+// A rule or shape statement as --watch last ran it, keyed by its file and
+// text: what it read and what it left behind.
+typedef struct Watch_Record {
+    std::string key;
+    std::vector<Watch_Read> reads;
+    bool shape;
+    std::string name;
+    Expr left;          // rules
+    Expr right;
+    std::string mod;    // shapes
+    Expr result;
+    bool reusable;      // ran to the end without diagnostics
+    uint64_t taken;     // the pass that last replayed it
+} Watch_Record;
+
+// A shape statement checked and resolved on the main thread, so running it
+// touches no interpreter state and cannot fail. `input` is the position in
+// the pending batch of the shape whose result this one starts from, or -1
+// when `expr` is already known.
+typedef struct Shape {
+    const std::string* file;    // source filename, for diagnostics
+    size_t line;
+    std::string name;
+    Expr expr;
+    int input;
+    std::vector<Shape_Step> steps;
+    std::string mod;
+    std::string out;
+    std::string err;
+    Watch_Record* record;   // where --watch keeps the result, if anywhere
+} Shape;
+
+typedef struct Shape_Profile {
+    std::string where;
+    std::string name;
+    Shape_Stats counts;
+    uint64_t built;
+    double seconds;
+} Shape_Profile;
+
+// A .soq file mapped read-only into memory. Tokens point into it, so
+// sources stay loaded for the rest of the run.
+typedef struct Source {
+    std::string filename;
+    const char* data;
+    size_t size;
+    std::string buffer;     // contents when the file could not be mapped
+public:
+    std::string_view text() const;
+    bool next_statement(size_t* pos, std::string_view* out) const;
+} Source;
+
+// A statement lexed ahead of execution, with the sides of a rule parsed
+// when it uses no macros; see run_source.
+typedef struct Prepared {
+    std::string_view line;
+    size_t lineno;
+    bool lexed;
+    Statement statement;
+    bool parsed;
+    Expr left;
+    Expr right;
+} Prepared;
 
 void print(const std::vector<std::string>);
 void print_rulebook();
-std::vector<std::string> read_file(const std::string);
-std::string tokenize_join(const std::string, const char);
-Statement parse_statement(const std::string);
-Statement expand_macros(const Statement statement);
+const Source& load_source(const std::string);
+Statement parse_statement(const std::string_view);
+Statement expand_macros(const Statement statement, std::vector<std::string>* uses);
 Statement merge_text(const Statement statement);
-Expr* parse_expr(std::string);
+Expr parse_expr(std::string_view);
+void import_source(const std::string);
+void import_file(const std::string);
+void run_shapes();
 void execute_import(const Statement); 
 void execute_rule(const Statement);
 void execute_shape(const Statement);
 void execute_macro(const Statement);
 void execute_statement(const Statement);
+void collect_if_due();
+void define_rule(const std::string, const Expr, const Expr);
+void enqueue_shape(Shape);
+bool watch_replay(std::string_view);
+Watch_Record* watch_begin(std::string_view, const Statement&, const std::vector<std::string>&);
+
+std::string_view Token::str() const {
+    return this->owned.empty()? this->view: std::string_view(this->owned);
+}
 
 void Token::print() const {
-    std::cout << this->type << "\t" << this->str;
+    std::cout << this->type << "\t" << this->str();
 }
 
 void Statement::print() const {
@@ -64,7 +192,7 @@ void Statement::print() const {
 std::string Statement::tostr() const {
     std::string str = "";
     for (Token token: this->tokens)
-        str += token.str + " ";
+        str += std::string(token.str()) + " ";
     return str;
 }
 
@@ -78,14 +206,105 @@ bool Statement::match(const std::vector<Token_Type> pattern) const {
     return true;
 }
 
-std::vector<std::string> lines;
-std::unordered_map<std::string, Rule*> rulebook;
-std::unordered_map<std::string, Expr*> exprbook;
-std::unordered_map<std::string, std::string> macros;
-std::unordered_set<char> special_chars = {'=', ':', '|', '{', '}', '"', ';', '@', '$'};
-std::unordered_map<std::string, Token_Type> symbol_type_map = {
+std::deque<Source> sources;
+// Errors are reported where they happen and end the run; a server or a
+// library session only abandons the request, so they throw this instead.
+typedef struct Sock_Error {} Sock_Error;
+bool throw_errors = false;
+
+[[noreturn]] void fail() {
+    if (throw_errors) throw Sock_Error();
+    exit(1);
+}
+
+size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+// --profile: rule counters by name, so redefinitions add up, and one entry
+// per shape run. Profiled runs are single-threaded to keep counts exact.
+bool profiling = false;
+std::string profile_json = "";
+std::unordered_map<std::string, Rule_Stats> rule_stats;
+std::vector<Shape_Profile> shape_profiles;
+// --fuel and --timeout: per-shape budgets, 0 for none.
+uint64_t shape_fuel = 0;
+double shape_timeout = 0;
+const size_t MAX_PENDING_SHAPES = 4096;
+size_t gc_threshold = 1 << 16;
+// bumped whenever term handles die
+uint64_t gc_generation = 0;
+bool use_soqc = false;
+
+// Definitions made while importing a file, replayed from its .soqc next
+// time. A file that runs shapes, or expands macros it did not bring in
+// itself, depends on its importer and is not compiled.
+typedef struct Import_Recorder {
+    std::vector<Soqc_Record> records;
+    std::unordered_set<std::string> macros;
+    bool cacheable;
+} Import_Recorder;
+
+// Everything a program defines: rules, named expressions and macros, with
+// the imports and queued shapes that go with them. Terms and symbols live
+// in the process-wide store, so a collection keeps every session's terms.
+typedef struct Session {
+    std::unordered_map<std::string, std::unique_ptr<Rule>> rulebook;
+    std::vector<std::string> rule_order;
+    Rule_Index rule_index;
+    bool rule_index_stale = false;
+    std::unordered_map<std::string, Normalizer> normalizers;
+    // bumped whenever the normalizers are dropped
+    uint64_t normalizer_generation = 0;
+    // Shapes queued since the last rule definition, with the batch position
+    // of the last one writing each name. Each worker keeps its own
+    // normalizers.
+    std::vector<Shape> pending_shapes;
+    std::unordered_map<std::string, int> pending_names;
+    std::vector<std::unordered_map<std::string, Normalizer>> worker_normalizers;
+    std::unordered_map<std::string, Expr> exprbook;
+    std::unordered_map<std::string, Macro> macros;
+    uint64_t macro_generation = 1;
+    // Files imported so far, by canonical path, with the macros each one
+    // brought in (itself or through its own imports).
+    std::unordered_map<std::string, std::vector<std::string>> imported;
+    std::vector<Import_Recorder> recorders;
+    // where the statement being executed starts
+    const std::string* statement_file = NULL;
+    size_t statement_line = 0;
+    // chunks of the sources being run, innermost import last
+    std::vector<std::vector<Prepared>*> prepared;
+    // `theories` points here while the session runs
+    Theory_Table theories;
+    // records of the .soqc files being replayed; a nested import may collect
+    std::vector<std::vector<Soqc_Record>*> replaying;
+} Session;
+
+// Every open session, and the one statements run in.
+std::vector<Session*> sessions;
+Session* session = NULL;
+
+// Makes `next` the session statements run in, with its theories.
+void enter_session(Session* next) {
+    session = next;
+    theories = (next != NULL)? &next->theories: &no_theories;
+}
+
+// --watch: the records of the last complete pass, by key, and those of the
+// pass under way in statement order.
+typedef struct Watch_Log {
+    bool active = false;
+    uint64_t pass = 0;
+    std::unordered_map<std::string, std::vector<Watch_Record>> last;
+    std::deque<Watch_Record> next;
+    Watch_Record* current = NULL;   // of the statement being executed
+    size_t ran = 0;
+    size_t replayed = 0;
+} Watch_Log;
+
+Watch_Log watch;
+std::unordered_map<std::string_view, Token_Type> symbol_type_map = {
     {"all", EXPR_MOD}, {"void", MOD}, {"dump", MOD}, 
-    {"$dump", MOD}, {"over", EXPR_MOD}, {"import", KEYWORD},
+    {"$dump", MOD}, {"&dump", MOD}, {"over", EXPR_MOD}, {"import", KEYWORD},
+    {"assoc", KEYWORD}, {"comm", KEYWORD},
+    {"inner", EXPR_MOD}, {"outer", EXPR_MOD}, {"lazy", EXPR_MOD},
 };
 
 std::string replaceString(
@@ -102,161 +321,356 @@ std::string replaceString(
     return result;
 }
 
+const Rule_Index& get_rule_index() {
+    if (session->rule_index_stale) {
+        session->rule_index.clear();
+        for (std::string name: session->rule_order) session->rule_index.add(session->rulebook[name].get());
+        session->rule_index_stale = false;
+    }
+    return session->rule_index;
+}
+
+const char* strategy_mod(Strategy strategy) {
+    switch (strategy) {
+        case Innermost: return "inner";
+        case Outermost: return "outer";
+        default: return "lazy";
+    }
+}
+
+Normalizer& get_normalizer(
+    std::unordered_map<std::string, Normalizer>& book,
+    const Shape_Step& step,
+    const Strategy strategy
+) {
+    std::string key = step.rulename + "|" + strategy_mod(strategy);
+    auto normalizer = book.find(key);
+    if (normalizer != book.end()) return normalizer->second;
+    Normalizer& created = book[key];
+    created.strategy = strategy;
+    if (step.rule == NULL) created.rules = session->rule_index;
+    else created.rules.add(step.rule);
+    return created;
+}
+
+void reset_normalizers(Session* owner) {
+    ++owner->normalizer_generation;
+    owner->normalizers.clear();
+    for (auto& book: owner->worker_normalizers) book.clear();
+}
+
+// Reclaims every term no longer reachable from a rule, a named expression
+// or a prepared statement of any session, the normal-form cache or the
+// --watch records. Memo tables would hold stale
+// handles, so they are dropped.
+void watch_roots(std::vector<Expr*>* roots) {
+    auto add = [&](Watch_Record& record) {
+        if (!record.reusable) return;
+        for (Watch_Read& read: record.reads)
+            if (read.key[0] == 'e' && read.value != 0) roots->push_back(&read.expr);
+        if (record.shape) roots->push_back(&record.result);
+        else {
+            roots->push_back(&record.left);
+            roots->push_back(&record.right);
+        }
+    };
+    for (auto& x: watch.last) for (Watch_Record& record: x.second) add(record);
+    for (Watch_Record& record: watch.next) add(record);
+}
+
+// The terms a session holds on to.
+void session_roots(Session* owner, std::vector<Expr*>* roots) {
+    for (auto& x: owner->exprbook) roots->push_back(&x.second);
+    for (auto& x: owner->rulebook) {
+        roots->push_back(&x.second->left);
+        roots->push_back(&x.second->right);
+    }
+    for (std::vector<Prepared>* chunk: owner->prepared) {
+        for (Prepared& prepared: *chunk) {
+            if (!prepared.parsed) continue;
+            roots->push_back(&prepared.left);
+            roots->push_back(&prepared.right);
+        }
+    }
+    for (Import_Recorder& recorder: owner->recorders) {
+        for (Soqc_Record& record: recorder.records) {
+            if (record.kind != SOQC_RULE) continue;
+            roots->push_back(&record.left);
+            roots->push_back(&record.right);
+        }
+    }
+    for (std::vector<Soqc_Record>* records: owner->replaying) {
+        for (Soqc_Record& record: *records) {
+            if (record.kind != SOQC_RULE) continue;
+            roots->push_back(&record.left);
+            roots->push_back(&record.right);
+        }
+    }
+}
+
+void collect_garbage() {
+    std::vector<Expr*> roots;
+    nf_cache.roots(&roots);
+    watch_roots(&roots);
+    for (Session* owner: sessions) session_roots(owner, &roots);
+    store.collect(roots);
+    ++gc_generation;
+    nf_cache.reindex();
+    // each session's rules compile under its own theories
+    Theory_Table* running = theories;
+    for (Session* owner: sessions) {
+        theories = &owner->theories;
+        for (auto& x: owner->rulebook) x.second->compile();
+        reset_normalizers(owner);
+    }
+    theories = running;
+    gc_threshold = std::max((size_t)1 << 16, store.size() * 2);
+}
+
 void print(const std::vector<std::string> lines) {
     for (std::string line: lines) std::cout << line << std::endl;
 }
 
 void print_rulebook() {
-    for (auto x: rulebook) {
+    for (auto& x: session->rulebook) {
         std::cout << x.first << " := ";
         x.second->print(); 
         std::cout << std::endl;
     }
 }
 
-std::vector<std::string> read_file(const std::string filename) {
-    std::ifstream fd(filename);
-    if (fd.fail()) {
-        std::cerr << "BAD FILE:: Filename `";
-        std::cerr << filename << "` specified does not exist" << std::endl;
-        exit(1);
+typedef enum {
+    CH_TEXT, CH_SPACE, CH_NEWLINE, CH_COMMENT, CH_SPECIAL,
+} Char_Class;
+
+// Byte classification for the lexer; everything not listed is text.
+struct Char_Table {
+    uint8_t classes[256];
+public:
+    Char_Table() {
+        for (int ch = 0; ch < 256; ++ch) this->classes[ch] = CH_TEXT;
+        for (char ch: std::string_view(" \t\r\v\f")) this->classes[(uint8_t)ch] = CH_SPACE;
+        for (char ch: std::string_view("=:|{}\";@$")) this->classes[(uint8_t)ch] = CH_SPECIAL;
+        this->classes[(uint8_t)'\n'] = CH_NEWLINE;
+        this->classes[(uint8_t)'#'] = CH_COMMENT;
     }
-    std::string line;
-    std::vector<std::string> lines;
-    while (getline(fd, line)) {
-        if (line.find("#") != std::string::npos) {
-            std::string tmp = "";
-            for (char ch: line) {
-                if (ch != '#') tmp.push_back(ch);
-                else break;
-            }  
-            line = tmp;
-        }
-        if (line.size() == 0) continue;
-        if (line.find("{") != std::string::npos && line.find("}") == std::string::npos) {
-            std::string tmp(line);
-            while (getline(fd, line)) {
-                if (line.find("#") != std::string::npos) {
-                    std::string tmp2 = "";
-                    for (char ch: line) {
-                        if (ch != '#') tmp2.push_back(ch);
-                        else break;
-                    }  
-                    line = tmp2;
-                }
-                tmp += line;
-                if (line.find("}") != std::string::npos) break;
-            }
-            line = tmp;
+    Char_Class operator[](char ch) const { return (Char_Class)this->classes[(uint8_t)ch]; }
+} char_table;
+
+std::string_view Source::text() const {
+    return std::string_view(this->data, this->size);
+}
+
+// Finds the next statement starting at `*pos`: everything up to a newline
+// that is not inside `{ ... }`. Comments are left for the lexer to skip.
+bool Source::next_statement(size_t* pos, std::string_view* out) const {
+    if (*pos >= this->size) return false;
+    size_t start = *pos, i = *pos;
+    int depth = 0;
+    for (; i < this->size; ++i) {
+        char ch = this->data[i];
+        if (ch == '\n' && depth == 0) break;
+        if (ch == '#') {
+            while (i + 1 < this->size && this->data[i+1] != '\n') ++i;
         }
-        lines.push_back(line);
+        else if (ch == '{') ++depth;
+        else if (ch == '}' && depth > 0) --depth;
     }
-    fd.close();
-    return lines;
+    *out = std::string_view(this->data + start, i - start);
+    *pos = i + 1;
+    return true;
 }
 
-std::string tokenize_join(const std::string str, const char del = ' ') {
-    std::string pre = "";
-    for (char ch: str) if (ch != del) pre.push_back(ch);
-    return pre;
+const Source& load_source(const std::string filename) {
+    Source source = {.filename = filename, .data = NULL, .size = 0};
+#ifndef _WIN32
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0) {
+        void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data != MAP_FAILED) {
+            source.data = (const char*)data;
+            source.size = info.st_size;
+            sources.push_back(source);
+            return sources.back();
+        }
+    }
+    else if (fd >= 0) close(fd);
+#endif
+    std::ifstream fd_in(filename, std::ios::binary);
+    if (fd_in.fail()) {
+        run_shapes();
+        std::cerr << "BAD FILE:: Filename `";
+        std::cerr << filename << "` specified does not exist" << std::endl;
+        fail();
+    }
+    std::stringstream buffer;
+    buffer << fd_in.rdbuf();
+    sources.push_back(source);
+    Source& loaded = sources.back();
+    loaded.buffer = buffer.str();
+    loaded.data = loaded.buffer.data();
+    loaded.size = loaded.buffer.size();
+    return loaded;
+}
+
+std::string_view trim(std::string_view str) {
+    auto space = [](char ch) { return char_table[ch] == CH_SPACE || char_table[ch] == CH_NEWLINE; };
+    while (!str.empty() && space(str.front())) str.remove_prefix(1);
+    while (!str.empty() && space(str.back())) str.remove_suffix(1);
+    return str;
 }
 
-Statement parse_statement(const std::string line) {
-    std::string tmp = tokenize_join(line);
+// Splits a statement into tokens; false if it holds an invalid one.
+bool lex_statement(const std::string_view line, Statement* out) {
     size_t i = 0;
     std::vector<Token> tokens; 
-    while (i < tmp.size()) {
-        char ch = tmp[i];
+    auto push = [&](Token_Type type, size_t start, size_t end) {
+        tokens.push_back((Token){.type = type, .view = line.substr(start, end - start)});
+    };
+    // symbols run up to the next special character or comment
+    auto symbol = [&](size_t start) {
+        while (i < line.size() && char_table[line[i]] != CH_SPECIAL && char_table[line[i]] != CH_COMMENT)
+            ++i;
+        std::string_view text = trim(line.substr(start, i - start));
+        if (text.empty()) return;
+        auto type = symbol_type_map.find(text);
+        tokens.push_back((Token){.type = (type != symbol_type_map.end())? type->second: TEXT, .view = text});
+    };
+    while (i < line.size()) {
+        char ch = line[i];
+        switch (char_table[ch]) {
+            case CH_SPACE:
+            case CH_NEWLINE: {
+                ++i;
+                continue;
+            }
+            case CH_COMMENT: {
+                while (i < line.size() && line[i] != '\n') ++i;
+                continue;
+            }
+            case CH_TEXT: {
+                symbol(i);
+                continue;
+            }
+            default: break;
+        }
         switch (ch) {
-            case ' ': {break;}
             case '=': {
+                push(EQUAL, i, i+1);
                 ++i;
-                tokens.push_back((Token){.type = EQUAL, .str = "="});
                 break;
             }
             case ':': {
-                if (i+1 < tmp.size() && tmp[i+1] == '=') {
+                if (i+1 < line.size() && line[i+1] == '=') {
+                    push(WALRUS, i, i+2);
                     i += 2;
-                    tokens.push_back((Token){.type = WALRUS, .str = ":="});
                     break;
-                } else {
-                    std::cerr << line << std::endl;
-                    std::cerr << "^^^ SYNTAX ERROR:: Not a valid token" << std::endl;
-                    exit(1);
                 }
+                return false;
             } 
             case '{': {
+                push(OPEN_CB, i, i+1);
                 ++i;
-                tokens.push_back((Token){.type = OPEN_CB, .str = "{"});
                 break;
             }
             case '}': {
+                push(CLOSE_CB, i, i+1);
                 ++i;
-                tokens.push_back((Token){.type = CLOSE_CB, .str = "}"});
                 break;
             }
             case '|': {
+                push(PIPE, i, i+1);
                 ++i;
-                tokens.push_back((Token){.type = PIPE, .str = "|"});
                 break;
             }
             case '"': {
+                push(QUOTE, i, i+1);
                 ++i;
-                tokens.push_back((Token){.type = QUOTE, .str = "\""});
                 break;
             }
             case '@': {
-                tokens.push_back((Token){.type = AT, .str = "@"});
-                ++i;
-                std::string symbol = "";
-                for (i; i < tmp.size() && isalnum(tmp[i]); ++i)
-                    symbol.push_back(tmp[i]);
-                tokens.push_back((Token){.type = TEXT, .str = symbol});
+                push(AT, i, i+1);
+                size_t start = ++i;
+                while (i < line.size() && isalnum((unsigned char)line[i])) ++i;
+                push(TEXT, start, i);
                 break;
             }
             case ';': {
+                push(SEMI_COLON, i, i+1);
                 ++i;
-                tokens.push_back((Token){.type = SEMI_COLON, .str = ";"});
                 break;
             }
             case '$': {
-                ++i;
-                std::string symbol = "$";
-                for (i; i < tmp.size() && special_chars.find(tmp[i]) == special_chars.end(); ++i)
-                    symbol.push_back(tmp[i]);
-                if (symbol_type_map.find(symbol) != symbol_type_map.end())
-                    tokens.push_back((Token){.type = symbol_type_map[symbol], .str = symbol});
-                else tokens.push_back((Token){.type = TEXT, .str = symbol});
+                size_t start = i++;
+                symbol(start);
                 break;
             }
-            default: {
-                std::string symbol = "";
-                for (i; i < tmp.size() && special_chars.find(tmp[i]) == special_chars.end(); ++i)
-                    symbol.push_back(tmp[i]);
-                if (symbol_type_map.find(symbol) != symbol_type_map.end())
-                    tokens.push_back((Token){.type = symbol_type_map[symbol], .str = symbol});
-                else tokens.push_back((Token){.type = TEXT, .str = symbol});
-            }
         }
     }
-    return (Statement){.tokens = tokens};
+    *out = (Statement){.tokens = tokens};
+    return true;
 }
 
-Statement expand_macros(const Statement statement) {
-    std::vector<Token> tokens;
-    size_t i = 0;
-    while (i < statement.tokens.size()) {
-        Token token = statement.tokens[i];
-        if (token.type != AT) {
-            tokens.push_back(token);
-            ++i;
+Statement parse_statement(const std::string_view line) {
+    Statement statement;
+    if (!lex_statement(line, &statement)) {
+        run_shapes();
+        std::cerr << line << std::endl;
+        std::cerr << "^^^ SYNTAX ERROR:: Not a valid token" << std::endl;
+        fail();
+    }
+    return statement;
+}
+
+const Macro& expand_macro(const std::string& name);
+
+// Appends `tokens` to `out` with every `@name` replaced by its expansion.
+void splice_macros(const std::vector<Token>& tokens, std::vector<Token>* out, std::vector<std::string>* uses) {
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        if (tokens[i].type != AT) {
+            out->push_back(tokens[i]);
             continue;
         }
-        std::string macro_name = statement.tokens[i+1].str;
-        Statement expanded = parse_statement(macros[macro_name]);
-        expanded = expand_macros(expanded);
-        for (Token x: expanded.tokens) tokens.push_back(x);
-        i += 2;
+        std::string name(tokens[++i].str());
+        const Macro& macro = expand_macro(name);
+        out->insert(out->end(), macro.expanded.begin(), macro.expanded.end());
+        uses->push_back(name);
+        uses->insert(uses->end(), macro.uses.begin(), macro.uses.end());
+    }
+}
+
+const Macro& expand_macro(const std::string& name) {
+    static const Macro undefined = {};
+    auto found = session->macros.find(name);
+    if (found == session->macros.end()) return undefined;
+    Macro& macro = found->second;
+    if (macro.generation == session->macro_generation) return macro;
+    if (macro.expanding) {
+        run_shapes();
+        std::cerr << "@" << name << " := " << macro.text << std::endl;
+        std::cerr << "^^^ MACRO CYCLE: Macro `" << name << "` expands to itself" << std::endl;
+        fail();
+    }
+    macro.expanding = true;
+    std::vector<Token> expanded;
+    std::vector<std::string> uses;
+    splice_macros(macro.tokens, &expanded, &uses);
+    macro.expanded.swap(expanded);
+    macro.uses.swap(uses);
+    macro.generation = session->macro_generation;
+    macro.expanding = false;
+    return macro;
+}
+
+Statement expand_macros(const Statement statement, std::vector<std::string>* uses) {
+    std::vector<Token> tokens;
+    splice_macros(statement.tokens, &tokens, uses);
+    if (!session->recorders.empty()) {
+        for (const std::string& name: *uses) {
+            if (session->recorders.back().macros.count(name) == 0) session->recorders.back().cacheable = false;
+        }
     }
     return (Statement){.tokens = tokens};
 }
@@ -264,164 +678,1253 @@ Statement expand_macros(const Statement statement) {
 Statement merge_text(const Statement statement) {
     std::vector<Token> tokens;
     for (size_t i = 0; i < statement.tokens.size(); ++i) {
-        if (statement.tokens[i].type == TEXT && i > 0 && tokens[tokens.size()-1].type == TEXT)
-            tokens[tokens.size()-1].str += statement.tokens[i].str;
+        if (statement.tokens[i].type == TEXT && i > 0 && tokens[tokens.size()-1].type == TEXT) {
+            Token& last = tokens[tokens.size()-1];
+            last.owned = std::string(last.str()) + std::string(statement.tokens[i].str());
+        }
         else tokens.push_back(statement.tokens[i]);
     }
     return (Statement){.tokens = tokens};
 }
 
-Expr* parse_expr(std::string str) {
-    std::stack<std::pair<Expr, bool>> stk;
+// Parses a term; false if `str` is not one.
+bool read_expr(std::string_view str, Expr* out) {
+    // open applications; the bottom frame collects the top-level result
+    std::vector<std::pair<std::string, std::vector<Expr>>> stk(1);
     std::string pre = "";
-    for (wchar_t ch: str) {
-        if (iswalnum(ch)) pre.push_back(ch);
+    for (char ch: str) {
+        if (isalnum((unsigned char)ch)) pre.push_back(ch);
+        else if (char_table[ch] == CH_SPACE || char_table[ch] == CH_NEWLINE) continue;
         else {
             switch (ch) {
                 case '(': {
-                    if (pre != "") stk.push(std::make_pair(
-                        (Expr){.type = Fun, .name = pre, .args = {}}, false
-                    ));
+                    stk.push_back(std::make_pair(pre, std::vector<Expr>()));
                     break;
                 }
                 case ')': {
-                    if (pre != "") stk.push(std::make_pair(
-                        (Expr){.type = Sym, .name = pre, .args = {}}, true
-                    ));
-                    std::vector<Expr> args;
-                    while (!stk.empty() && !(stk.top().first.type == Fun && !stk.top().second)) {
-                        args.push_back(stk.top().first.clone());
-                        stk.pop();
-                    }
-                    if (stk.empty()) {
-                        if (args.size() == 1) {
-                            stk.push(std::make_pair(args[0], true)); 
-                        }
-                    } else {
-                        std::reverse(args.begin(), args.end());
-                        Expr expr = stk.top().first;
-                        stk.pop();
-                        expr.args = args;
-                        stk.push(std::make_pair(expr, true));
+                    if (pre != "") stk.back().second.push_back(make_sym(symbols.intern(pre)));
+                    if (stk.size() == 1) {
+                        return false;
                     }
+                    auto frame = stk.back();
+                    stk.pop_back();
+                    if (frame.first != "")
+                        stk.back().second.push_back(make_fun(symbols.intern(frame.first), frame.second));
+                    else for (Expr arg: frame.second) stk.back().second.push_back(arg);
                     break;
                 }
                 case ',': {
-                    if (pre != "") stk.push(std::make_pair(
-                        (Expr){.type = Sym, .name = pre, .args = {}}, true
-                    ));
+                    if (pre != "") stk.back().second.push_back(make_sym(symbols.intern(pre)));
                     break;
                 }
                 default:
-                    std::cerr << str << std::endl;
-                    std::cerr << "^^^ INVALID EXPR" << std::endl;
-                    exit(1);
+                    return false;
             }
             pre = "";
         }
     }
-    if (stk.empty()) {
-        Expr* tmp = new Expr();
-        tmp->type = Sym;
-        tmp->name = pre;
-        tmp->args = {};
-        return tmp;
-    } else {
-        Expr* tmp = new Expr(stk.top().first);
-        return tmp;
+    if (stk.size() != 1) return false;
+    if (pre != "" || stk.back().second.empty()) *out = make_sym(symbols.intern(pre));
+    else *out = stk.back().second.back();
+    return true;
+}
+
+Expr parse_expr(std::string_view str) {
+    Expr expr;
+    if (!read_expr(str, &expr)) {
+        run_shapes();
+        std::cerr << str << std::endl;
+        std::cerr << "^^^ INVALID EXPR" << std::endl;
+        fail();
+    }
+    return expr;
+}
+
+void run_statement(std::string_view line, Prepared* prepared = NULL) {
+    if (watch.active && watch_replay(line)) return;
+    Statement statement = (prepared != NULL && prepared->lexed)? prepared->statement: parse_statement(line);
+    if (statement.tokens.empty()) return;
+    std::vector<std::string> uses;
+    if (!statement.match(MACRO_SYNTAX)) statement = expand_macros(statement, &uses);
+    statement = merge_text(statement);
+    if (watch.active) watch.current = watch_begin(line, statement, uses);
+    if (prepared != NULL && prepared->parsed) {
+        prepared->parsed = false;
+        define_rule(std::string(statement.tokens[0].str()), prepared->left, prepared->right);
+        collect_if_due();
+    }
+    else execute_statement(statement);
+    Watch_Record* record = watch.current;
+    watch.current = NULL;
+    if (record == NULL || record->shape) return;
+    const Rule& rule = *session->rulebook[record->name];
+    record->left = rule.left;
+    record->right = rule.right;
+    record->reusable = true;
+}
+
+// Lexes a chunk of statements, and parses the sides of rules that use no
+// macros, on `jobs` threads. Neither depends on what ran before; a
+// statement that fails here is left for run_statement to report in order.
+void prepare_statements(std::vector<Prepared>* chunk) {
+    const size_t block = 64;
+    size_t workers = std::min(jobs, chunk->size() / block);
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (;;) {
+            size_t begin = next.fetch_add(block);
+            if (begin >= chunk->size()) return;
+            for (size_t i = begin; i < std::min(begin + block, chunk->size()); ++i) {
+                Prepared& prepared = (*chunk)[i];
+                prepared.lexed = lex_statement(prepared.line, &prepared.statement);
+                if (!prepared.lexed || !prepared.statement.match(RULE_SYNTAX)) continue;
+                bool macros = false;
+                for (const Token& token: prepared.statement.tokens) macros |= token.type == AT;
+                if (macros) continue;
+                Statement statement = merge_text(prepared.statement);
+                prepared.parsed = statement.match(RULE_SYNTAX)
+                    && read_expr(statement.tokens[2].str(), &prepared.left)
+                    && read_expr(statement.tokens[4].str(), &prepared.right);
+            }
+        }
+    };
+    bool shared = store_shared;
+    store_shared = true;
+    std::vector<std::thread> threads;
+    for (size_t worker = 0; worker < workers; ++worker) threads.emplace_back(work);
+    for (std::thread& thread: threads) thread.join();
+    store_shared = shared;
+}
+
+// Statements are found up front and run a chunk at a time. With more than
+// one job a big enough chunk is prepared in parallel first; macro
+// expansion and execution stay sequential.
+void run_source(const Source& source) {
+    const size_t chunk_size = 4096, parallel = 256;
+    size_t pos = 0, lineno = 1, counted = 0;
+    std::string_view line;
+    std::vector<Prepared> chunk;
+    session->prepared.push_back(&chunk);
+    bool more = true;
+    while (more) {
+        chunk.clear();
+        while (chunk.size() < chunk_size && (more = source.next_statement(&pos, &line))) {
+            size_t start = line.data() - source.data;
+            lineno += std::count(source.data + counted, source.data + start, '\n');
+            counted = start;
+            chunk.push_back((Prepared){.line = line, .lineno = lineno, .lexed = false, .parsed = false});
+        }
+        if (jobs > 1 && chunk.size() >= parallel) prepare_statements(&chunk);
+        for (Prepared& prepared: chunk) {
+            session->statement_file = &source.filename;
+            session->statement_line = prepared.lineno;
+            try {
+                run_statement(prepared.line, &prepared);
+            }
+            catch (const Sock_Error&) {
+                session->prepared.pop_back();
+                throw;
+            }
+        }
+    }
+    session->prepared.pop_back();
+}
+
+void import_source(const std::string filename) {
+    run_source(load_source(filename));
+}
+
+std::string canonical_path(const std::string filename) {
+    std::error_code error;
+    std::filesystem::path path = std::filesystem::weakly_canonical(filename, error);
+    return error? filename: path.string();
+}
+
+void define_rule(const std::string name, const Expr left, const Expr right) {
+    // queued shapes hold pointers into the rulebook
+    run_shapes();
+    std::unique_ptr<Rule> rule(new Rule());
+    rule->left = left;
+    rule->right = right;
+    rule->compile();
+    if (profiling) rule->stats = &rule_stats[name];
+    auto slot = session->rulebook.try_emplace(name);
+    if (slot.second) session->rule_order.push_back(name);
+    slot.first->second = std::move(rule);
+    session->rule_index_stale = true;
+    reset_normalizers(session);
+    if (!session->recorders.empty())
+        session->recorders.back().records.push_back((Soqc_Record){.kind = SOQC_RULE, .name = name, .left = left, .right = right});
+}
+
+void define_macro(const std::string name, const std::string text) {
+    ++session->macro_generation;
+    Macro& macro = session->macros[name];
+    macro.text = text;
+    macro.tokens = parse_statement(macro.text).tokens;
+    if (session->recorders.empty()) return;
+    session->recorders.back().records.push_back((Soqc_Record){.kind = SOQC_MACRO, .name = name, .text = text});
+    session->recorders.back().macros.insert(name);
+}
+
+// The value `key` reads now; see Watch_Read. A queued shape may be about
+// to write the expression, so the queue is run first.
+uint64_t watch_value(const std::string& key, Expr* expr) {
+    std::string name = key.substr(1);
+    switch (key[0]) {
+        case 'r': {
+            auto rule = session->rulebook.find(name);
+            return (rule == session->rulebook.end())? 0: rule->second->fingerprint;
+        }
+        case '?': return get_rule_index().fingerprint;
+        case 't': return session->theories.fingerprint;
+        case 'e': {
+            if (session->pending_names.count(name) > 0) run_shapes();
+            auto found = session->exprbook.find(name);
+            if (found == session->exprbook.end()) return 0;
+            *expr = found->second;
+            return 1;
+        }
+        default: {
+            auto macro = session->macros.find(name);
+            return (macro == session->macros.end())? 0: std::hash<std::string>()(macro->second.text) | 1;
+        }
+    }
+}
+
+bool watch_holds(const Watch_Record& record) {
+    for (const Watch_Read& read: record.reads) {
+        Expr expr = {0};
+        if (watch_value(read.key, &expr) != read.value) return false;
+        if (read.key[0] == 'e' && read.value != 0 && expr.id != read.expr.id) return false;
+    }
+    return true;
+}
+
+// Replays `line` from the last pass if it ran there and everything it read
+// still has the value it had then: a rule is defined again from its terms,
+// a shape is queued with its result and no steps.
+bool watch_replay(std::string_view line) {
+    if (session->statement_file == NULL) return false;
+    auto found = watch.last.find(*session->statement_file + '\n' + std::string(line));
+    if (found == watch.last.end()) return false;
+    for (Watch_Record& record: found->second) {
+        if (!record.reusable || record.taken == watch.pass || !watch_holds(record)) continue;
+        record.taken = watch.pass;
+        watch.next.push_back(record);
+        Watch_Record* replayed = &watch.next.back();
+        ++watch.replayed;
+        if (!replayed->shape) {
+            define_rule(replayed->name, replayed->left, replayed->right);
+            return true;
+        }
+        enqueue_shape((Shape){
+            .file = session->statement_file, .line = session->statement_line, .name = replayed->name,
+            .expr = replayed->result, .input = -1, .mod = replayed->mod, .record = replayed
+        });
+        return true;
+    }
+    return false;
+}
+
+// Starts the record of a rule or shape statement about to run, reading
+// its inputs before it changes anything.
+Watch_Record* watch_begin(std::string_view line, const Statement& statement, const std::vector<std::string>& uses) {
+    bool shape = statement.match(SHAPE_SYNTAX);
+    if ((!shape && !statement.match(RULE_SYNTAX)) || session->statement_file == NULL) return NULL;
+    Watch_Record record = {
+        .key = *session->statement_file + '\n' + std::string(line), .shape = shape,
+        .name = std::string(statement.tokens[0].str()), .reusable = false, .taken = 0
     };
+    // terms are parsed and rewritten under the theories declared so far
+    std::vector<std::string> keys = {"t"};
+    for (const std::string& name: uses) keys.push_back("m" + name);
+    if (shape) {
+        keys.push_back("e" + std::string(statement.tokens[2].str()));
+        for (size_t i = 4; i+3 < statement.tokens.size(); i += 4) {
+            std::string rulename(statement.tokens[i].str());
+            keys.push_back((rulename == "?")? rulename: "r" + rulename);
+        }
+        record.mod = std::string(statement.tokens[statement.tokens.size()-1].str());
+    }
+    for (const std::string& key: keys) {
+        Watch_Read read = {.key = key, .value = 0, .expr = {0}};
+        read.value = watch_value(key, &read.expr);
+        record.reads.push_back(read);
+    }
+    ++watch.ran;
+    watch.next.push_back(record);
+    return &watch.next.back();
+}
+
+// Runs `filename` from its .soqc when that is current, otherwise from
+// source, compiling it on the way if it only makes definitions. Returns
+// the macros it defined.
+std::vector<std::string> import_compiled(const std::string filename) {
+    std::string compiled = filename + "c";
+    Soqc_Stamp stamp;
+    bool stamped = soqc_stamp(filename, &stamp);
+    std::vector<Soqc_Record> records;
+    if (stamped && soqc_read(compiled, stamp, &records)) {
+        session->recorders.push_back((Import_Recorder){.cacheable = false});
+        session->replaying.push_back(&records);
+        try {
+            for (const Soqc_Record& record: records) {
+                if (record.kind == SOQC_IMPORT) import_file(record.name);
+                else if (record.kind == SOQC_RULE) define_rule(record.name, record.left, record.right);
+                else define_macro(record.name, record.text);
+            }
+        }
+        catch (const Sock_Error&) {
+            session->replaying.pop_back();
+            throw;
+        }
+        session->replaying.pop_back();
+    }
+    else {
+        session->recorders.push_back((Import_Recorder){.cacheable = true});
+        import_source(filename);
+    }
+    Import_Recorder recorder = std::move(session->recorders.back());
+    session->recorders.pop_back();
+    if (stamped && recorder.cacheable) soqc_write(compiled, stamp, recorder.records);
+    return std::vector<std::string>(recorder.macros.begin(), recorder.macros.end());
+}
+
+// Each file is imported at most once per run; it is marked before it runs
+// so an import cycle ends at the file that started it.
+void import_file(const std::string filename) {
+    std::string path = canonical_path(filename);
+    if (session->imported.find(path) == session->imported.end()) {
+        session->imported[path] = {};
+        try {
+            if (use_soqc) session->imported[path] = import_compiled(filename);
+            else import_source(filename);
+        }
+        catch (const Sock_Error&) {
+            // so the file can be imported again once it is fixed
+            session->imported.erase(path);
+            throw;
+        }
+    }
+    if (session->recorders.empty()) return;
+    Import_Recorder& recorder = session->recorders.back();
+    recorder.records.push_back((Soqc_Record){.kind = SOQC_IMPORT, .name = filename});
+    for (const std::string& macro: session->imported[path]) recorder.macros.insert(macro);
 }
 
 void execute_import(const Statement statement) {
-    std::string filename = statement.tokens[2].str;
-    for (std::string line: read_file(filename)) {
-        Statement statement = parse_statement(line);
-        if (!statement.match(MACRO_SYNTAX)) statement = expand_macros(statement);
-        statement = merge_text(statement);
-        execute_statement(statement);
+    import_file(std::string(statement.tokens[2].str()));
+}
+
+// `assoc "f"` and `comm "f"`, for the running session only. The terms it
+// holds are reinterned into canonical form and its rules recompiled against
+// the new theory; other sessions' terms sharing the store are left as they
+// are. Declarations last until the program is reloaded.
+void declare_theory(Atom head, uint8_t flag) {
+    Theory_Table& table = session->theories;
+    if (theory(head) & flag) return;
+    // queued shapes may be matching against the old theory
+    run_shapes();
+    if (table.flags.size() <= head) table.flags.resize(head + 1, 0);
+    table.flags[head] |= flag;
+    // order-free, so the same theories fingerprint alike however declared
+    table.fingerprint = 0;
+    for (Atom atom = 0; atom < table.flags.size(); ++atom)
+        if (table.flags[atom] != 0) table.fingerprint ^= fingerprint_mix(name_fingerprint(symbols.name(atom)), table.flags[atom]);
+    std::vector<Expr*> roots;
+    session_roots(session, &roots);
+    std::unordered_map<uint32_t, Expr> done;
+    for (Expr* root: roots) *root = canonical_term(*root, &done);
+    for (auto& x: session->rulebook) x.second->compile();
+    session->rule_index_stale = true;
+    reset_normalizers(session);
+}
+
+void execute_theory(const Statement statement) {
+    std::string_view keyword = statement.tokens[0].str();
+    std::string name(statement.tokens[2].str());
+    if (keyword != "assoc" && keyword != "comm") {
+        run_shapes();
+        std::cerr << statement.tostr() << std::endl;
+        std::cerr << "^^^ SYNTAX ERROR: Does not match any pattern" << std::endl;
+        fail();
+    }
+    if (name == "s") {
+        run_shapes();
+        std::cerr << statement.tostr() << std::endl;
+        std::cerr << "^^^ INVALID THEORY: `s` is the successor and has no theory" << std::endl;
+        fail();
     }
+    // an import's cached records would skip the declaration
+    if (!session->recorders.empty()) session->recorders.back().cacheable = false;
+    declare_theory(symbols.intern(name), (keyword == "assoc")? THEORY_ASSOC: THEORY_COMM);
 }
 
 void execute_rule(const Statement statement) {
-    std::string name = statement.tokens[0].str;
-    Expr* left_expr = parse_expr(statement.tokens[2].str);
-    Expr* right_expr = parse_expr(statement.tokens[4].str);
-    Rule* rule = new Rule();
-    rule->left = left_expr;
-    rule->right = right_expr;
-    rulebook[name] = rule;
-}
-
-void execute_shape(const Statement statement) {
-    std::string name = statement.tokens[0].str;
-    std::string expr_str = statement.tokens[2].str;
-    Expr* expr = (exprbook.find(expr_str) == exprbook.end())?
-         parse_expr(statement.tokens[2].str): exprbook[expr_str];
+    define_rule(
+        std::string(statement.tokens[0].str()),
+        parse_expr(statement.tokens[2].str()),
+        parse_expr(statement.tokens[4].str())
+    );
+}
+
+Shape prepare_shape(const Statement statement) {
+    Shape shape = {
+        .file = session->statement_file, .line = session->statement_line,
+        .name = std::string(statement.tokens[0].str()), .input = -1, .record = watch.current
+    };
+    if (!session->recorders.empty()) session->recorders.back().cacheable = false;
+    std::string expr_str(statement.tokens[2].str());
+    auto written = session->pending_names.find(expr_str);
+    if (written != session->pending_names.end()) shape.input = written->second;
+    else if (session->exprbook.find(expr_str) != session->exprbook.end()) shape.expr = session->exprbook[expr_str];
+    else shape.expr = parse_expr(statement.tokens[2].str());
     for (size_t i = 4; i+3 < statement.tokens.size(); i += 4) {
-        std::string rulename = statement.tokens[i].str;
-        if (rulebook.find(rulename) == rulebook.end() && rulename != "?") {
+        Shape_Step step = {.rulename = std::string(statement.tokens[i].str()), .rule = NULL};
+        auto rule = session->rulebook.find(step.rulename);
+        if (rule != session->rulebook.end()) step.rule = rule->second.get();
+        else if (step.rulename == "?") get_rule_index();
+        else {
+            run_shapes();
             std::cerr << statement.tostr() << std::endl;
-            std::cerr << "^^^ EXISTENTIAL CRISIS: Rule `" << rulename << "` does not exist" << std::endl;
-            exit(1);
-        }
-        std::string expr_mod = statement.tokens[i+2].str;
-        if (expr_mod == "all") {
-            if (rulename != "?") rulebook[rulename]->apply_all(expr);
-            else for (auto x: rulebook) x.second->apply_all(expr);
+            std::cerr << "^^^ EXISTENTIAL CRISIS: Rule `" << step.rulename << "` does not exist" << std::endl;
+            fail();
         }
-        else if (expr_mod == "over") rulebook[rulename]->apply(expr);
-        else {
+        step.mod = std::string(statement.tokens[i+2].str());
+        if (step.mod != "all" && step.mod != "inner" && step.mod != "outer" && step.mod != "lazy" && step.mod != "over") {
+            run_shapes();
             std::cerr << statement.tostr() << std::endl;
             std::cerr << "^^^ INVALID EXPR MOD: Expression mod `";
-            std::cerr << expr_mod << "` is not valid" << std::endl;
-            exit(1);
+            std::cerr << step.mod << "` is not valid" << std::endl;
+            fail();
         }
+        shape.steps.push_back(step);
     }
-    std::string mod = statement.tokens[statement.tokens.size()-1].str;
-    if (mod == "void");
-    else if (mod == "dump") {
-        expr->print();
-        std::cout << std::endl;
+    shape.mod = std::string(statement.tokens[statement.tokens.size()-1].str());
+    if (shape.mod != "void" && shape.mod != "dump" && shape.mod != "$dump" && shape.mod != "&dump") {
+        run_shapes();
+        std::cerr << statement.tostr() << std::endl;
+        std::cerr << "^^^ INVALID MOD: Mod `" << shape.mod << "` is not valid" << std::endl;
+        fail();
     }
-    else if (mod == "$dump") {
-        std::cout << expr->value() << std::endl;
+    return shape;
+}
+
+// Where a step's result lives in the normal-form cache; `over` steps are
+// cheap and not cached.
+bool nf_cache_key(const Shape_Step& step, uint64_t* rules, uint8_t* mode) {
+    if (!nf_cache.enabled || step.mod == "over") return false;
+    *rules = (step.rule != NULL)? step.rule->fingerprint: session->rule_index.fingerprint;
+    // the same rules rewrite differently under other theories
+    if (session->theories.fingerprint != 0) *rules = fingerprint_mix(*rules, session->theories.fingerprint);
+    if (step.mod == "all") *mode = NFC_ALL;
+    else *mode = (step.mod == "inner")? Innermost: (step.mod == "outer")? Outermost: Lazy;
+    return true;
+}
+
+template <bool profiled>
+Expr run_steps(const Shape* shape, std::unordered_map<std::string, Normalizer>& book, Fuel* fuel, std::string* err) {
+    Expr expr = shape->expr;
+    for (const Shape_Step& step: shape->steps) {
+        uint64_t rules;
+        uint8_t mode;
+        Expr input = expr;
+        bool cached = nf_cache_key(step, &rules, &mode);
+        if (cached && nf_cache.find(rules, mode, input, &expr)) continue;
+        if (step.mod == "all") {
+            if (step.rule != NULL) step.rule->apply_all<profiled>(&expr, fuel);
+            else session->rule_index.apply_all<profiled>(&expr, fuel);
+        }
+        else if (step.mod == "inner") expr = get_normalizer(book, step, Innermost).normalize<profiled>(expr, fuel);
+        else if (step.mod == "outer") expr = get_normalizer(book, step, Outermost).normalize<profiled>(expr, fuel);
+        else if (step.mod == "lazy") expr = get_normalizer(book, step, Lazy).normalize<profiled>(expr, fuel);
+        else if (!((step.rule != NULL)? try_rule<profiled>(step.rule, &expr): try_rules<profiled>(&session->rule_index, &expr)))
+            *err += "Rule does not match with the given Expr\n";
+        if (fuel->out()) break;
+        if (cached) nf_cache.insert(rules, mode, input, expr);
     }
-    else {
-        std::cerr << statement.tostr() << std::endl;
-        std::cerr << "^^^ INVALID MOD: Mod `" << mod << "` is not valid" << std::endl;
-        exit(1);
+    return expr;
+}
+
+std::string shape_where(const Shape* shape) {
+    if (shape->file == NULL) return "";
+    return *shape->file + ":" + std::to_string(shape->line);
+}
+
+// Terms in diagnostics are cut short; a runaway term can be huge.
+std::string term_excerpt(Expr expr) {
+    const size_t width = 120;
+    std::string str = expr.tostr();
+    return (str.size() <= width)? str: str.substr(0, width) + "...";
+}
+
+void fuel_diagnostic(const Shape* shape, const Fuel& fuel, std::string* err) {
+    std::string where = shape_where(shape);
+    if (!where.empty()) *err += where + "\n";
+    *err += "^^^ ";
+    switch (fuel.state.load()) {
+        case Fuel_Steps:
+            *err += "OUT OF FUEL: Shape `" + shape->name + "` needs more than ";
+            *err += std::to_string(fuel.limit) + " rewrites\n";
+            break;
+        case Fuel_Time:
+        {
+            char seconds[32];
+            snprintf(seconds, sizeof seconds, "%g", shape_timeout);
+            *err += "OUT OF TIME: Shape `" + shape->name + "` ran past " + seconds + "s\n";
+            break;
+        }
+        default:
+            *err += "REWRITE CYCLE: Shape `" + shape->name + "` reaches `";
+            *err += term_excerpt(fuel.cycle) + "` again\n";
+    }
+}
+
+// Only interns terms, so it is safe to run on a worker thread with its
+// own normalizers. Output is collected in the shape. A shape that runs out
+// of fuel or into a cycle prints a diagnostic instead of its result and
+// keeps the term as it stood.
+void run_shape(Shape* shape, std::unordered_map<std::string, Normalizer>& book) {
+    Expr expr;
+    Fuel fuel;
+    fuel.start(shape_fuel, shape_timeout);
+    if (profiling) {
+        Shape_Profile profile = {.where = shape_where(shape), .name = shape->name, .counts = {0, 0}};
+        shape_stats = &profile.counts;
+        size_t before = store.size();
+        auto start = std::chrono::steady_clock::now();
+        expr = run_steps<true>(shape, book, &fuel, &shape->err);
+        profile.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        profile.built = store.size() - before;
+        shape_stats = NULL;
+        shape_profiles.push_back(profile);
+    }
+    else expr = run_steps<false>(shape, book, &fuel, &shape->err);
+    shape->expr = expr;
+    if (fuel.out()) {
+        fuel_diagnostic(shape, fuel, &shape->err);
+        return;
+    }
+    if (shape->mod == "dump") expr.write(&shape->out);
+    else if (shape->mod == "&dump") expr.write_shared(&shape->out);
+    else if (shape->mod == "$dump") shape->out = std::to_string(expr.value());
+    if (shape->mod != "void") shape->out += '\n';
+}
+
+void finish_shape(const Shape& shape) {
+    std::cerr << shape.err;
+    std::cout << shape.out;
+    if (shape.name != "_") session->exprbook[shape.name] = shape.expr;
+    if (shape.record == NULL) return;
+    shape.record->result = shape.expr;
+    shape.record->reusable = shape.err.empty();
+}
+
+void enqueue_shape(Shape shape) {
+    if (jobs <= 1) {
+        run_shape(&shape, session->normalizers);
+        finish_shape(shape);
+        return;
+    }
+    if (shape.name != "_") session->pending_names[shape.name] = session->pending_shapes.size();
+    session->pending_shapes.push_back(shape);
+    if (session->pending_shapes.size() >= MAX_PENDING_SHAPES) run_shapes();
+}
+
+void queue_shape(const Statement statement) {
+    enqueue_shape(prepare_shape(statement));
+}
+
+// Runs the queued shapes on `jobs` threads. Workers take shapes in order;
+// one whose input is an earlier shape's result waits for it, and that
+// shape has already been taken, so the wait always ends. The main thread
+// prints results in statement order as they complete.
+void run_shapes() {
+    std::vector<Shape> shapes;
+    shapes.swap(session->pending_shapes);
+    session->pending_names.clear();
+    size_t workers = std::min(jobs, shapes.size());
+    if (workers <= 1) {
+        for (Shape& shape: shapes) {
+            if (shape.input >= 0) shape.expr = shapes[shape.input].expr;
+            run_shape(&shape, session->normalizers);
+            finish_shape(shape);
+        }
+        return;
+    }
+    if (session->worker_normalizers.size() < workers) session->worker_normalizers.resize(workers);
+    std::vector<char> done(shapes.size(), false);
+    std::mutex lock;
+    std::condition_variable finished;
+    size_t next = 0;
+    auto wait_for = [&](size_t i) {
+        std::unique_lock<std::mutex> hold(lock);
+        finished.wait(hold, [&]() { return done[i] != 0; });
+    };
+    auto work = [&](size_t worker) {
+        for (;;) {
+            size_t i;
+            {
+                std::lock_guard<std::mutex> hold(lock);
+                if (next == shapes.size()) return;
+                i = next++;
+            }
+            Shape& shape = shapes[i];
+            if (shape.input >= 0) {
+                wait_for(shape.input);
+                shape.expr = shapes[shape.input].expr;
+            }
+            run_shape(&shape, session->worker_normalizers[worker]);
+            {
+                std::lock_guard<std::mutex> hold(lock);
+                done[i] = true;
+            }
+            finished.notify_all();
+        }
+    };
+    bool shared = store_shared;
+    store_shared = true;
+    std::vector<std::thread> threads;
+    for (size_t worker = 0; worker < workers; ++worker) threads.emplace_back(work, worker);
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        wait_for(i);
+        finish_shape(shapes[i]);
     }
-    if (name == "_") return;
-    else exprbook[name] = expr;
+    for (std::thread& thread: threads) thread.join();
+    store_shared = shared;
 }
 
 void execute_macro(const Statement statement) {
-    std::string name = statement.tokens[1].str;
+    std::string name(statement.tokens[1].str());
     std::string val = "";
     for (size_t i = 3; i < statement.tokens.size(); ++i) 
-        val += statement.tokens[i].str;
-    macros[name] = val;
+        val += statement.tokens[i].str();
+    define_macro(name, val);
+}
+
+void collect_if_due() {
+    if (session->pending_shapes.empty() && store.size() > gc_threshold) collect_garbage();
 }
 
 void execute_statement(const Statement statement) {
-    if (statement.match(IMPORT_SYNTAX)) execute_import(statement);
+    if (statement.match(IMPORT_SYNTAX) && statement.tokens[0].str() == "import") execute_import(statement);
     else if (statement.match(RULE_SYNTAX)) execute_rule(statement);
-    else if (statement.match(SHAPE_SYNTAX)) execute_shape(statement);
+    else if (statement.match(SHAPE_SYNTAX)) queue_shape(statement);
     else if (statement.match(MACRO_SYNTAX)) execute_macro(statement);
+    else if (statement.match(THEORY_SYNTAX)) execute_theory(statement);
     else {
+        run_shapes();
         std::cerr << statement.tostr() << std::endl;
         std::cerr << "^^^ SYNTAX ERROR: Does not match any pattern" << std::endl;
+        fail();
+    }
+    collect_if_due();
+}
+
+std::string json_string(const std::string str) {
+    std::string out = "\"";
+    for (char ch: str) {
+        if (ch == '"' || ch == '\\') out.push_back('\\');
+        if ((unsigned char)ch < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof escaped, "\\u%04x", ch);
+            out += escaped;
+        }
+        else out.push_back(ch);
+    }
+    return out + "\"";
+}
+
+void write_profile_json(
+    const std::vector<std::pair<std::string, Rule_Stats>>& rules,
+    const std::vector<Shape_Profile>& shapes
+) {
+    std::ofstream out(profile_json);
+    if (out.fail()) {
+        std::cerr << "BAD FILE:: Could not write profile to `" << profile_json << "`" << std::endl;
+        return;
+    }
+    out << "{\"rules\": [";
+    for (size_t i = 0; i < rules.size(); ++i) {
+        const Rule_Stats& stats = rules[i].second;
+        out << (i? ", ": "") << "{\"rule\": " << json_string(rules[i].first);
+        out << ", \"attempts\": " << stats.attempts << ", \"hits\": " << stats.hits;
+        out << ", \"built\": " << stats.built << ", \"ms\": " << stats.seconds * 1e3 << "}";
+    }
+    out << "], \"shapes\": [";
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        const Shape_Profile& shape = shapes[i];
+        out << (i? ", ": "") << "{\"where\": " << json_string(shape.where);
+        out << ", \"name\": " << json_string(shape.name);
+        out << ", \"rewrites\": " << shape.counts.rewrites << ", \"visits\": " << shape.counts.visits;
+        out << ", \"built\": " << shape.built << ", \"ms\": " << shape.seconds * 1e3 << "}";
+    }
+    out << "]}" << std::endl;
+}
+
+// Rules and shapes sorted by time spent, slowest first. The text report
+// goes to stderr and shows the top of each list; the JSON has everything.
+void print_profile() {
+    const size_t shown = 20;
+    std::vector<std::pair<std::string, Rule_Stats>> rules(rule_stats.begin(), rule_stats.end());
+    std::sort(rules.begin(), rules.end(), [](const auto& a, const auto& b) {
+        return a.second.seconds != b.second.seconds? a.second.seconds > b.second.seconds: a.first < b.first;
+    });
+    std::vector<Shape_Profile> shapes = shape_profiles;
+    std::stable_sort(shapes.begin(), shapes.end(), [](const Shape_Profile& a, const Shape_Profile& b) {
+        return a.seconds > b.seconds;
+    });
+    fprintf(stderr, "PROFILE:: rules by time\n");
+    fprintf(stderr, "  %-24s %12s %12s %12s %12s\n", "rule", "attempts", "hits", "built", "ms");
+    for (size_t i = 0; i < rules.size() && i < shown; ++i) {
+        const Rule_Stats& stats = rules[i].second;
+        fprintf(stderr, "  %-24s %12llu %12llu %12llu %12.3f\n", rules[i].first.c_str(),
+            (unsigned long long)stats.attempts, (unsigned long long)stats.hits,
+            (unsigned long long)stats.built, stats.seconds * 1e3);
+    }
+    if (rules.size() > shown) fprintf(stderr, "  ... %zu more\n", rules.size() - shown);
+    fprintf(stderr, "PROFILE:: shapes by time\n");
+    fprintf(stderr, "  %-24s %-12s %12s %12s %12s %12s\n", "where", "name", "rewrites", "visits", "built", "ms");
+    for (size_t i = 0; i < shapes.size() && i < shown; ++i) {
+        const Shape_Profile& shape = shapes[i];
+        fprintf(stderr, "  %-24s %-12s %12llu %12llu %12llu %12.3f\n", shape.where.c_str(), shape.name.c_str(),
+            (unsigned long long)shape.counts.rewrites, (unsigned long long)shape.counts.visits,
+            (unsigned long long)shape.built, shape.seconds * 1e3);
+    }
+    if (shapes.size() > shown) fprintf(stderr, "  ... %zu more\n", shapes.size() - shown);
+    if (!profile_json.empty()) write_profile_json(rules, shapes);
+}
+
+// std::cout and std::cerr write into the reply the calling thread is
+// building, if any, so requests print as they would to a terminal.
+thread_local std::string* reply = NULL;
+
+typedef struct Reply_Buffer: public std::streambuf {
+    std::streambuf* fallback;
+protected:
+    int overflow(int ch) override {
+        if (ch == EOF) return 0;
+        char byte = ch;
+        this->xsputn(&byte, 1);
+        return ch;
+    }
+    std::streamsize xsputn(const char* data, std::streamsize size) override {
+        if (reply != NULL) reply->append(data, size);
+        else this->fallback->sputn(data, size);
+        return size;
+    }
+    int sync() override {
+        return (reply != NULL)? 0: this->fallback->pubsync();
+    }
+} Reply_Buffer;
+
+Reply_Buffer out_buffer, err_buffer;
+
+void capture_output() {
+    static std::once_flag installed;
+    std::call_once(installed, []() {
+        out_buffer.fallback = std::cout.rdbuf(&out_buffer);
+        err_buffer.fallback = std::cerr.rdbuf(&err_buffer);
+    });
+}
+
+// Undoes what an abandoned statement may have left half done. Shapes
+// queued before it still run; they were complete statements.
+void recover() {
+    session->recorders.clear();
+    for (auto& macro: session->macros) macro.second.expanding = false;
+    run_shapes();
+}
+
+// A dump shape running `expr` through every rule under `strategy`.
+Shape normal_form_shape(Expr expr, Strategy strategy) {
+    Shape_Step step = {.rulename = "?", .rule = NULL, .mod = strategy_mod(strategy)};
+    return (Shape){.file = NULL, .line = 0, .name = "_", .expr = expr, .input = -1, .steps = {step}, .mod = "dump"};
+}
+
+// Library entry points, declared in sock.h. Each one makes its session
+// current and collects what the statements print into `out`; errors are
+// reported there too instead of ending the process.
+typedef struct Session_Call {
+    Session* previous;
+    std::string* previous_reply;
+public:
+    Session_Call(Session* current, std::string* out);
+    ~Session_Call();
+} Session_Call;
+
+Session_Call::Session_Call(Session* current, std::string* out) {
+    this->previous = session;
+    this->previous_reply = reply;
+    enter_session(current);
+    out->clear();
+    reply = out;
+}
+
+Session_Call::~Session_Call() {
+    enter_session(this->previous);
+    reply = this->previous_reply;
+}
+
+Session* session_open() {
+    throw_errors = true;
+    capture_output();
+    Session* opened = new Session();
+    sessions.push_back(opened);
+    return opened;
+}
+
+void session_close(Session* closed) {
+    sessions.erase(std::find(sessions.begin(), sessions.end(), closed));
+    if (session == closed) enter_session(NULL);
+    delete closed;
+}
+
+bool session_load(Session* current, const std::string& filename, std::string* out) {
+    Session_Call call(current, out);
+    try {
+        import_file(filename);
+        run_shapes();
+        return true;
+    }
+    catch (const Sock_Error&) {
+        recover();
+        return false;
+    }
+}
+
+bool session_run(Session* current, const std::string& statements, std::string* out) {
+    static const std::string filename = "<session>";
+    Session_Call call(current, out);
+    Source source = {.filename = filename, .data = statements.data(), .size = statements.size()};
+    try {
+        run_source(source);
+        run_shapes();
+        return true;
+    }
+    catch (const Sock_Error&) {
+        recover();
+        return false;
+    }
+}
+
+bool session_normalize(Session* current, const std::string& expr, Strategy strategy, std::string* out) {
+    std::string printed;
+    Session_Call call(current, &printed);
+    Shape shape;
+    try {
+        get_rule_index();
+        auto named = current->exprbook.find(expr);
+        shape = normal_form_shape((named != current->exprbook.end())? named->second: parse_expr(expr), strategy);
+        run_shape(&shape, current->normalizers);
+    }
+    catch (const Sock_Error&) {
+        *out = printed;
+        return false;
+    }
+    if (!shape.err.empty()) {
+        *out = shape.err;
+        return false;
+    }
+    *out = shape.out.substr(0, shape.out.size() - 1);
+    return true;
+}
+
+size_t session_normalize_all(
+    Session* current,
+    const std::vector<std::string>& exprs,
+    Strategy strategy,
+    std::vector<std::string>* out
+) {
+    size_t failed = 0;
+    out->resize(exprs.size());
+    for (size_t i = 0; i < exprs.size(); ++i) {
+        if (session_normalize(current, exprs[i], strategy, &(*out)[i])) continue;
+        (*out)[i].clear();
+        ++failed;
+    }
+    return failed;
+}
+
+size_t session_normalize_stream(Session* current, std::istream& in, std::ostream& out, Strategy strategy) {
+    size_t failed = 0;
+    std::string line, result;
+    while (std::getline(in, line)) {
+        if (session_normalize(current, std::string(trim(line)), strategy, &result)) out << result;
+        else {
+            std::cerr << result;
+            ++failed;
+        }
+        out << '\n';
+    }
+    out.flush();
+    return failed;
+}
+
+#ifndef _WIN32
+// --serve and --socket PATH: keep the startup file loaded and answer
+// requests, one per line (a shape may go on while its braces are open).
+// A statement runs as it would in a file; any other line is an expression
+// and is answered with its normal form under every rule, `? | inner`.
+// `:reload` reruns the startup file from scratch and `:quit` ends the
+// session. A reply is whatever the request printed, then an empty line.
+//
+// Statements change shared state and run one at a time. Expressions only
+// read it, so those from different clients run at once, each client with
+// its own normalizers; terms are interned under the store mutex.
+std::shared_mutex server_lock;
+std::string startup_file = "";
+const std::string client_source = "<client>";
+
+typedef struct Client {
+    int in;
+    int out;
+    std::string pending;    // read past the last line
+    size_t requests;
+    std::unordered_map<std::string, Normalizer> book;
+    uint64_t generation;    // normalizer_generation `book` was built in
+public:
+    bool next_line(std::string* line);
+    bool next_request(std::string* request);
+    bool send(const std::string& text);
+} Client;
+
+bool Client::next_line(std::string* line) {
+    for (;;) {
+        size_t end = this->pending.find('\n');
+        if (end != std::string::npos) {
+            *line = this->pending.substr(0, end);
+            this->pending.erase(0, end + 1);
+            return true;
+        }
+        char buffer[4096];
+        ssize_t got = read(this->in, buffer, sizeof buffer);
+        if (got <= 0) {
+            if (this->pending.empty()) return false;
+            line->swap(this->pending);
+            this->pending.clear();
+            return true;
+        }
+        this->pending.append(buffer, got);
+    }
+}
+
+bool Client::next_request(std::string* request) {
+    if (!this->next_line(request)) return false;
+    auto open = [](const std::string& text) {
+        return std::count(text.begin(), text.end(), '{') > std::count(text.begin(), text.end(), '}');
+    };
+    std::string line;
+    while (open(*request) && this->next_line(&line)) *request += "\n" + line;
+    return true;
+}
+
+bool Client::send(const std::string& text) {
+    for (size_t sent = 0; sent < text.size();) {
+        ssize_t put = write(this->out, text.data() + sent, text.size() - sent);
+        if (put <= 0) return false;
+        sent += put;
+    }
+    return true;
+}
+
+void unload_sources() {
+    for (const Source& source: sources)
+        if (source.buffer.empty() && source.data != NULL) munmap((void*)source.data, source.size);
+    sources.clear();
+}
+
+void reload() {
+    session->rulebook.clear();
+    session->rule_order.clear();
+    session->rule_index.clear();
+    session->rule_index_stale = false;
+    session->exprbook.clear();
+    session->macros.clear();
+    ++session->macro_generation;
+    session->imported.clear();
+    unload_sources();
+    // the program declares its theories again as it runs
+    session->theories = Theory_Table();
+    collect_garbage();
+    if (startup_file.empty()) return;
+    session->imported[canonical_path(startup_file)] = {};
+    import_source(startup_file);
+}
+
+void serve_statement(Client* client, std::string_view request) {
+    std::unique_lock<std::shared_mutex> hold(server_lock);
+    try {
+        if (request == ":reload") reload();
+        else {
+            session->statement_file = &client_source;
+            session->statement_line = client->requests;
+            run_statement(request);
+        }
+        run_shapes();
+    }
+    catch (const Sock_Error&) {
+        recover();
+    }
+    // expressions read the index without rebuilding it
+    get_rule_index();
+}
+
+void serve_expr(Client* client, std::string_view request) {
+    std::string text(trim(request));
+    Shape shape = normal_form_shape(Expr(), Innermost);
+    shape.file = &client_source;
+    shape.line = client->requests;
+    try {
+        for (;;) {
+            uint64_t generation;
+            {
+                // parsing interns symbols, which only statements may do
+                std::unique_lock<std::shared_mutex> hold(server_lock);
+                auto named = session->exprbook.find(text);
+                shape.expr = (named != session->exprbook.end())? named->second: parse_expr(text);
+                generation = gc_generation;
+            }
+            std::shared_lock<std::shared_mutex> hold(server_lock);
+            if (generation != gc_generation) continue;
+            if (client->generation != session->normalizer_generation) {
+                client->book.clear();
+                client->generation = session->normalizer_generation;
+            }
+            run_shape(&shape, client->book);
+            break;
+        }
+    }
+    catch (const Sock_Error&) {}
+    std::cerr << shape.err;
+    std::cout << shape.out;
+}
+
+bool is_statement(const Statement& statement) {
+    for (const Token& token: statement.tokens)
+        if (token.type == WALRUS || token.type == KEYWORD || token.type == AT) return true;
+    return false;
+}
+
+void serve(Client* client) {
+    std::string request, out;
+    while (client->next_request(&request)) {
+        client->requests += 1;
+        std::string_view line = trim(request);
+        if (line == ":quit") break;
+        out.clear();
+        reply = &out;
+        if (line == ":reload") serve_statement(client, line);
+        else if (!line.empty() && line[0] != '#') {
+            Statement statement;
+            try {
+                statement = parse_statement(request);
+            }
+            catch (const Sock_Error&) {}
+            if (is_statement(statement)) serve_statement(client, request);
+            else if (!statement.tokens.empty()) serve_expr(client, request);
+        }
+        reply = NULL;
+        if (!client->send(out + "\n")) break;
+    }
+}
+
+void serve_client(int fd) {
+    Client client = {.in = fd, .out = fd, .requests = 0, .generation = 0};
+    serve(&client);
+    close(fd);
+}
+
+void start_server(const std::string socket_path) {
+    throw_errors = true;
+    capture_output();
+    get_rule_index();
+    if (socket_path.empty()) {
+        Client client = {.in = STDIN_FILENO, .out = STDOUT_FILENO, .requests = 0, .generation = 0};
+        serve(&client);
+        return;
+    }
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_path.size() >= sizeof address.sun_path || fd < 0) {
+        std::cerr << "BAD SOCKET:: Could not open `" << socket_path << "`" << std::endl;
+        exit(1);
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+    unlink(socket_path.c_str());
+    if (bind(fd, (struct sockaddr*)&address, sizeof address) < 0 || listen(fd, 64) < 0) {
+        std::cerr << "BAD SOCKET:: Could not listen on `" << socket_path << "`" << std::endl;
         exit(1);
     }
+    // a client that hangs up mid-reply must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+    store_shared = true;
+    for (;;) {
+        int client = accept(fd, NULL, NULL);
+        if (client >= 0) std::thread(serve_client, client).detach();
+    }
 }
 
-int main(int argc, char* argv[]) {
-    std::string filename = (argc > 1)? std::string(argv[1]): "sock.soq";
-    for (std::string line: read_file(filename)) {
-        Statement statement = parse_statement(line);
-        if (!statement.match(MACRO_SYNTAX)) statement = expand_macros(statement);
-        statement = merge_text(statement);
-        execute_statement(statement); 
+// --watch FILE: runs the file, then again from scratch whenever it or a
+// file it imported changes. Statements that ran before with the same
+// inputs are replayed instead of run, so an edit costs only the statements
+// that depend on it. Errors end the pass, not the process.
+std::vector<std::pair<std::string, std::filesystem::file_time_type>> watch_stamps() {
+    std::vector<std::pair<std::string, std::filesystem::file_time_type>> stamps;
+    std::error_code error;
+    stamps.emplace_back(startup_file, std::filesystem::last_write_time(startup_file, error));
+    for (const Source& source: sources)
+        stamps.emplace_back(source.filename, std::filesystem::last_write_time(source.filename, error));
+    return stamps;
+}
+
+void watch_pass() {
+    ++watch.pass;
+    watch.ran = 0;
+    watch.replayed = 0;
+    auto start = std::chrono::steady_clock::now();
+    try {
+        reload();
+        run_shapes();
+        watch.last.clear();
+        for (Watch_Record& record: watch.next) watch.last[record.key].push_back(std::move(record));
+    }
+    catch (const Sock_Error&) {
+        recover();
+    }
+    watch.next.clear();
+    watch.current = NULL;
+    double millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout.flush();
+    std::cerr << "WATCH:: " << watch.ran << " ran, " << watch.replayed << " replayed in ";
+    std::cerr << (uint64_t)millis << "ms" << std::endl;
+}
+
+void watch_file(const std::string filename) {
+    throw_errors = true;
+    use_soqc = false;
+    watch.active = true;
+    startup_file = filename;
+    for (;;) {
+        watch_pass();
+        auto stamps = watch_stamps();
+        while (watch_stamps() == stamps) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}
+#endif
+
+// --batch: normal forms of the expressions on stdin, one per line, under
+// the rules of the named file.
+int run_batch(const std::string filename, Strategy strategy) {
+    std::ios::sync_with_stdio(false);
+    Session* batch = session_open();
+    std::string out;
+    bool loaded = filename.empty() || session_load(batch, filename, &out);
+    // the file's own output would mix with the results
+    std::cerr << out;
+    if (!loaded) return 1;
+    return (session_normalize_stream(batch, std::cin, std::cout, strategy) == 0)? 0: 1;
+}
+
+void save_nf_cache() {
+    if (!nf_cache.save(nf_cache.filename))
+        std::cerr << "BAD CACHE:: Could not write `" << nf_cache.filename << "`" << std::endl;
+}
+
+int sock_main(int argc, char* argv[]) {
+    std::string filename = "sock.soq";
+    bool named = false, serve_stdin = false, batch = false, watching = false;
+    Strategy strategy = Innermost;
+    std::string socket_path = "";
+    std::string emit_path = "";
+    int split = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--soqc") use_soqc = true;
+        else if ((arg == "-j" || arg == "--jobs") && i+1 < argc) jobs = std::max(1, atoi(argv[++i]));
+        else if (arg == "--split" && i+1 < argc) split = atoi(argv[++i]);
+        else if (arg == "--split-cutoff" && i+1 < argc) split_cutoff = std::max(1, atoi(argv[++i]));
+        else if (arg == "--fuel" && i+1 < argc) shape_fuel = strtoull(argv[++i], NULL, 10);
+        else if (arg == "--timeout" && i+1 < argc) shape_timeout = std::max(0.0, atof(argv[++i]));
+        else if (arg == "--profile") profiling = true;
+        else if (arg == "--profile-json" && i+1 < argc) {
+            profiling = true;
+            profile_json = argv[++i];
+        }
+        else if (arg == "--serve") serve_stdin = true;
+        else if (arg == "--batch") batch = true;
+        else if (arg == "--watch") watching = true;
+        else if (arg == "--strategy" && i+1 < argc) {
+            std::string mod(argv[++i]);
+            strategy = (mod == "outer")? Outermost: (mod == "lazy")? Lazy: Innermost;
+        }
+        else if (arg == "--socket" && i+1 < argc) socket_path = argv[++i];
+        else if (arg == "--emit-cpp" && i+1 < argc) emit_path = argv[++i];
+        else if (arg == "--nf-cache") nf_cache.enabled = true;
+        else if (arg == "--nf-cache-file" && i+1 < argc) {
+            nf_cache.enabled = true;
+            nf_cache.filename = argv[++i];
+        }
+        else {
+            filename = arg;
+            named = true;
+        }
+    }
+    bool server = serve_stdin || !socket_path.empty();
+    if (profiling && !socket_path.empty()) {
+        std::cerr << "--profile is ignored with --socket" << std::endl;
+        profiling = false;
+    }
+    if (profiling) jobs = 1;
+    else if (split > 1) rewrite_pool.start(split);
+    // handlers run in reverse: pending shapes finish before the report
+    if (profiling) atexit(print_profile);
+    if (!nf_cache.filename.empty()) {
+        nf_cache.load(nf_cache.filename);
+        atexit(save_nf_cache);
+    }
+    if (batch) return run_batch(named? filename: "", strategy);
+    enter_session(new Session());
+    sessions.push_back(session);
+    // statements that exit with an error still let earlier shapes finish
+    atexit(run_shapes);
+    if (server && !named) filename = "";
+    if (watching) {
+#ifndef _WIN32
+        watch_file(filename);
+#else
+        std::cerr << "Watch mode needs a POSIX system" << std::endl;
+        return 1;
+#endif
+    }
+    if (!filename.empty()) {
+        session->imported[canonical_path(filename)] = {};
+        import_source(filename);
+    }
+    run_shapes();
+    if (!emit_path.empty()) {
+        std::vector<const Rule*> rules;
+        for (const std::string& name: session->rule_order) rules.push_back(session->rulebook[name].get());
+        if (emit_cpp(emit_path, filename, rules, session->rule_order)) return 0;
+        std::cerr << "BAD EMIT:: Could not write `" << emit_path << "`" << std::endl;
+        return 1;
+    }
+    if (server) {
+#ifndef _WIN32
+        startup_file = filename;
+        start_server(socket_path);
+#else
+        std::cerr << "Server mode needs a POSIX system" << std::endl;
+        return 1;
+#endif
     }
     return 0;
 }
+
+#ifndef SOCK_LIBRARY
+int main(int argc, char* argv[]) {
+    return sock_main(argc, argv);
+}
+#endif // SOCK_LIBRARY
@@ -0,0 +1,47 @@
+#ifndef SOCK_H_
+#define SOCK_H_
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+// Embedding API. `make lib` builds bin/libsock.a; link it with -pthread.
+//
+//   Session* session = session_open();
+//   std::string out;
+//   if (!session_load(session, "examples/std.soq", &out)) std::cerr << out;
+//   session_normalize(session, "add(s(0), s(0))", Innermost, &out);
+//
+// A session owns its rules, named expressions, macros and `comm`/`assoc`
+// declarations. Every session shares the process-wide term store, so use them from one thread at a
+// time. Errors never end the process: the call returns false and its
+// output holds the diagnostic. Every call replaces `out` rather than
+// appending to it.
+
+// Lazy is outermost and call by need: arguments are normalized one at a
+// time, only until a rule matches at the root again.
+typedef enum {
+    Innermost,
+    Outermost,
+    Lazy
+} Strategy;
+
+typedef struct Session Session;
+
+Session* session_open();
+void session_close(Session*);
+// Runs a .soq file, at most once per session, as `import` would.
+bool session_load(Session*, const std::string& filename, std::string* out);
+// Runs statements written as in a .soq file; `out` gets what they print.
+bool session_run(Session*, const std::string& statements, std::string* out);
+// The normal form of `expr`, or the name of a stored expression, under
+// every rule of the session.
+bool session_normalize(Session*, const std::string& expr, Strategy, std::string* out);
+// Normalizes each expression; failed ones come back empty. Returns how
+// many failed.
+size_t session_normalize_all(Session*, const std::vector<std::string>& exprs, Strategy, std::vector<std::string>* out);
+// One expression per line in, one normal form per line out; a line that
+// fails gives an empty line, with the diagnostic on std::cerr.
+size_t session_normalize_stream(Session*, std::istream& in, std::ostream& out, Strategy);
+
+#endif // SOCK_H_
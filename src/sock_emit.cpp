@@ -0,0 +1,196 @@
+#ifndef SOCK_EMIT_CPP_
+#define SOCK_EMIT_CPP_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <unordered_map>
+#include "sock_enr.cpp"
+
+// --emit-cpp: the rulebook as C++. Each rule becomes one function doing
+// what its matcher and builder programs do, with the stack unrolled into
+// locals and every head, arity and successor test inlined; Rule_Index
+// still picks the candidates at a node by head and arity. The output
+// includes interpreter.cpp, so building it with -Isrc gives an interpreter
+// that runs these rules natively wherever a program defines them
+// unchanged. Rules are recognized by fingerprint, not by name. Rules
+// matched modulo a theory search for their match and stay interpreted.
+
+typedef struct Cpp_Emitter {
+    std::string code;
+    std::vector<std::string> atoms;
+    std::unordered_map<Atom, size_t> atom_at;
+    size_t temps;
+public:
+    std::string atom(Atom);
+    std::string temp();
+    std::string term(Expr);
+    void rule(const std::string& name, size_t index, const Rule& rule);
+} Cpp_Emitter;
+
+std::string Cpp_Emitter::atom(Atom head) {
+    auto at = this->atom_at.emplace(head, this->atoms.size());
+    if (at.second) this->atoms.push_back(symbols.name(head));
+    return "atoms[" + std::to_string(at.first->second) + "]";
+}
+
+std::string Cpp_Emitter::temp() {
+    return "t" + std::to_string(this->temps++);
+}
+
+// Emits code interning a ground term, arguments first and each shared
+// subterm once; returns the local holding it.
+std::string Cpp_Emitter::term(Expr expr) {
+    std::unordered_map<uint32_t, std::string> done;
+    std::vector<Expr> stack = {expr};
+    while (!stack.empty()) {
+        Expr top = stack.back();
+        if (done.count(top.id)) {
+            stack.pop_back();
+            continue;
+        }
+        const Expr_Node& node = store.node(top);
+        bool ready = true;
+        for (Expr arg: node.args) {
+            if (done.count(arg.id)) continue;
+            stack.push_back(arg);
+            ready = false;
+        }
+        if (!ready) continue;
+        stack.pop_back();
+        std::string head = this->atom(node.head);
+        std::vector<std::string> args;
+        for (Expr arg: node.args) args.push_back(done[arg.id]);
+        std::string out = this->temp();
+        if (node.type == Sym) this->code += "    Expr " + out + " = make_sym(" + head + ");\n";
+        else if (node.type == Num)
+            this->code += "    Expr " + out + " = store.intern_num(" + std::to_string(node.count) + ", " + args[0] + ");\n";
+        else if (args.empty()) this->code += "    Expr " + out + " = store.intern(Fun, " + head + ", NULL, 0);\n";
+        else {
+            std::string array = this->temp();
+            this->code += "    const Expr " + array + "[] = {";
+            for (size_t i = 0; i < args.size(); ++i) this->code += (i? ", ": "") + args[i];
+            this->code += "};\n";
+            this->code += "    Expr " + out + " = store.intern(Fun, " + head + ", " + array + ", " + std::to_string(args.size()) + ");\n";
+        }
+        done[top.id] = out;
+    }
+    return done[expr.id];
+}
+
+void Cpp_Emitter::rule(const std::string& name, size_t index, const Rule& rule) {
+    this->temps = 0;
+    this->code += "// " + name + " := " + rule.left.tostr() + " = " + rule.right.tostr() + "\n";
+    this->code += "static bool rule_" + std::to_string(index) + "(Expr* expr) {\n";
+    // slots nothing reads are not kept, so the output is warning-clean
+    std::vector<bool> read(rule.slots, false);
+    for (const Instr& instr: rule.matcher) if (instr.op == MATCH_SAME) read[instr.arg] = true;
+    for (const Instr& instr: rule.builder) if (instr.op == BUILD_SLOT) read[instr.arg] = true;
+    std::vector<std::string> stack = {"*expr"};
+    for (size_t at = 0; at < rule.matcher.size(); ++at) {
+        const Instr& instr = rule.matcher[at];
+        std::string subject = stack.back();
+        stack.pop_back();
+        std::string slot = "v" + std::to_string(instr.arg);
+        switch (instr.op) {
+            case MATCH_FUN: {
+                std::string node = this->temp();
+                this->code += "    const Expr_Node& " + node + " = store.node(" + subject + ");\n";
+                this->code += "    if (" + node + ".type != Fun || " + node + ".head != " + this->atom(instr.head);
+                this->code += " || " + node + ".args.size() != " + std::to_string(instr.arg) + ") return false;\n";
+                for (size_t i = instr.arg; i-- > 0;) stack.push_back(node + ".args[" + std::to_string(i) + "]");
+                break;
+            }
+            case MATCH_SUCC: {
+                std::string node = this->temp(), rest = this->temp();
+                std::string count = std::to_string(instr.arg);
+                this->code += "    const Expr_Node& " + node + " = store.node(" + subject + ");\n";
+                this->code += "    if (" + node + ".type != Num || " + node + ".count < " + count + ") return false;\n";
+                // the next instruction takes the rest; an unread slot needs none
+                const Instr& next = rule.matcher[at + 1];
+                if (next.op != MATCH_BIND || read[next.arg])
+                    this->code += "    Expr " + rest + " = store.intern_num(" + node + ".count - " + count + ", " + node + ".args[0]);\n";
+                stack.push_back(rest);
+                break;
+            }
+            case MATCH_BIND:
+                if (read[instr.arg]) this->code += "    Expr " + slot + " = " + subject + ";\n";
+                break;
+            case MATCH_SAME: this->code += "    if (" + slot + ".id != " + subject + ".id) return false;\n"; break;
+            default: break;
+        }
+    }
+    for (const Instr& instr: rule.builder) {
+        switch (instr.op) {
+            case BUILD_SLOT: stack.push_back("v" + std::to_string(instr.arg)); break;
+            case BUILD_CONST: stack.push_back(this->term((Expr){.id = instr.arg})); break;
+            case BUILD_FUN: {
+                std::vector<std::string> args(stack.end() - instr.arg, stack.end());
+                stack.resize(stack.size() - instr.arg);
+                std::string head = this->atom(instr.head), out = this->temp();
+                if (args.empty()) this->code += "    Expr " + out + " = store.intern(Fun, " + head + ", NULL, 0);\n";
+                else {
+                    std::string array = this->temp();
+                    this->code += "    const Expr " + array + "[] = {";
+                    for (size_t i = 0; i < args.size(); ++i) this->code += (i? ", ": "") + args[i];
+                    this->code += "};\n";
+                    this->code += "    Expr " + out + " = store.intern(Fun, " + head + ", " + array + ", " + std::to_string(args.size()) + ");\n";
+                }
+                stack.push_back(out);
+                break;
+            }
+            case BUILD_SUCC: {
+                std::string out = this->temp();
+                this->code += "    Expr " + out + " = store.intern_num(" + std::to_string(instr.arg) + ", " + stack.back() + ");\n";
+                stack.back() = out;
+                break;
+            }
+            default: break;
+        }
+    }
+    this->code += "    *expr = " + stack.back() + ";\n";
+    this->code += "    return true;\n}\n\n";
+}
+
+std::string cpp_string(const std::string& text) {
+    std::string out = "\"";
+    for (char ch: text) {
+        if (ch == '"' || ch == '\\') out += '\\';
+        out += ch;
+    }
+    return out + "\"";
+}
+
+// Writes the rules, in definition order, as a C++ file whose main installs
+// them and runs the interpreter.
+bool emit_cpp(const std::string filename, const std::string source, const std::vector<const Rule*>& rules, const std::vector<std::string>& names) {
+    Cpp_Emitter emitter = {.temps = 0};
+    for (size_t i = 0; i < rules.size(); ++i)
+        if (!rules[i]->theory) emitter.rule(names[i], i, *rules[i]);
+    std::ofstream out(filename);
+    if (out.fail()) return false;
+    out << "// Generated by `interpreter --emit-cpp` from " << source << "; build with\n";
+    out << "//   g++ -std=c++17 -O2 -pthread -Isrc " << filename << "\n";
+    out << "#define SOCK_LIBRARY\n";
+    out << "#include \"interpreter.cpp\"\n\n";
+    out << "static const char* const atom_names[] = {";
+    for (const std::string& name: emitter.atoms) out << cpp_string(name) << ", ";
+    out << "NULL};\n";
+    out << "static Atom atoms[" << emitter.atoms.size() + 1 << "];\n\n";
+    out << emitter.code;
+    out << "int main(int argc, char* argv[]) {\n";
+    out << "    for (size_t i = 0; atom_names[i] != NULL; ++i) atoms[i] = symbols.intern(atom_names[i]);\n";
+    for (size_t i = 0; i < rules.size(); ++i) {
+        if (rules[i]->theory) continue;
+        char fingerprint[32];
+        snprintf(fingerprint, sizeof fingerprint, "0x%016llxULL", (unsigned long long)rules[i]->fingerprint);
+        out << "    native_matchers[" << fingerprint << "] = rule_" << i << ";\n";
+    }
+    out << "    return sock_main(argc, argv);\n";
+    out << "}\n";
+    out.close();
+    return !out.fail();
+}
+
+#endif // SOCK_EMIT_CPP_
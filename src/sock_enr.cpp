@@ -3,61 +3,523 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string>
 #include <iostream>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
-#include <optional>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include "sock.h"
 
 typedef enum {
     Sym,
-    Fun
+    Fun,
+    Num     // s(s(...s(base))) stored as a count over args()[0]
 } Expr_Type;
 
+// Interned symbol name; heads and variables compare as integers.
+typedef uint32_t Atom;
+
+// Interning locks while the store is shared; names are only read while
+// nothing interns.
+typedef struct Symbol_Table {
+    std::deque<std::string> names;
+    std::unordered_map<std::string, Atom> atoms;
+    std::mutex lock;
+public:
+    Atom intern(const std::string&);
+    const std::string& name(Atom) const;
+    int compare(Atom, Atom);
+} Symbol_Table;
+
+Symbol_Table symbols;
+
+// Peano successor; s(...) chains are stored as Num nodes.
+Atom succ_atom = symbols.intern("s");
+
+// Equational theories declared with `assoc f` and `comm f`, by atom. Terms
+// headed by an associative symbol are interned flattened and those headed
+// by a commutative one with their arguments sorted, so terms equal modulo
+// the theory are one node. Each session keeps its own table and `theories`
+// points at the running session's; only changed while no shapes run.
+const uint8_t THEORY_ASSOC = 1;
+const uint8_t THEORY_COMM = 2;
+
+typedef struct Theory_Table {
+    std::vector<uint8_t> flags;
+    // of the declared theories by symbol name, so results made under other
+    // theories are told apart; 0 while none is declared
+    uint64_t fingerprint = 0;
+} Theory_Table;
+
+Theory_Table no_theories;
+Theory_Table* theories = &no_theories;
+
+uint8_t theory(Atom head) {
+    return (head < theories->flags.size())? theories->flags[head]: 0;
+}
+
+typedef struct Expr Expr;
+
+// Non-owning view of a node's arguments inside the store's arena.
+typedef struct Expr_Args {
+    const Expr* data;
+    size_t count;
+public:
+    const Expr* begin() const;
+    const Expr* end() const;
+    size_t size() const;
+    const Expr& operator[](size_t) const;
+} Expr_Args;
+
+// Handle to a hash-consed term living in the global `store`; two handles
+// are structurally equal iff their ids are equal.
 typedef struct Expr {
-    Expr_Type type;
-    std::string name; 
-    std::vector<Expr> args;
-public:   
+    uint32_t id;
+public:
+    Expr_Type type() const;
+    Atom head() const;
+    const std::string& name() const;
+    Expr_Args args() const;
     void print() const;
     bool equal(const Expr*) const;
-    std::string tostr() const; 
-    std::optional<std::unordered_map<std::string, Expr>> match(const Expr*) const;
-    void apply(std::unordered_map<std::string, Expr> bindings);
-    Expr clone() const;
-    int value() const;
-private:
-    bool match_helper(
-        const Expr*, 
-        std::unordered_map<std::string, Expr>* bindings
-    ) const;
+    std::string tostr() const;
+    void write(std::string*) const;
+    void write_shared(std::string*) const;
+    uint64_t count() const;
+    uint64_t value() const;
 } Expr;
 
+typedef struct Expr_Node {
+    Expr_Type type;
+    Atom head;
+    Expr_Args args;
+    uint64_t count;     // Num only: how many s(...) wrap args[0]
+    uint32_t hash;
+    uint32_t size;      // nodes in the tree, shared subterms counted each time; saturates
+} Expr_Node;
+
+// Bump allocator for argument arrays. Chunks are never moved and are only
+// released all at once, when the store they belong to is dropped.
+typedef struct Expr_Arena {
+    std::vector<std::unique_ptr<Expr[]>> chunks;
+    size_t used;
+    size_t capacity;
+public:
+    Expr* alloc(size_t count);
+} Expr_Arena;
+
+#define NODE_CHUNK_BITS 16
+
+// Every distinct (type, head, args) is stored exactly once. Nodes live in
+// fixed-size chunks reached through a table that never moves, and their
+// arguments in an arena, so nodes can be read while new terms are interned,
+// even from another thread. Arguments are always interned before their
+// parent, hence a node's id is larger than the ids of its arguments.
+typedef struct Expr_Store {
+    std::unique_ptr<std::unique_ptr<Expr_Node[]>[]> chunks;
+    size_t count;
+    Expr_Arena arena;
+    std::vector<uint32_t> index;   // open addressing over node ids
+public:
+    Expr_Store();
+    Expr intern(Expr_Type, Atom, const Expr* args, size_t arity);
+    Expr intern_num(uint64_t count, Expr base);
+    const Expr_Node& node(Expr) const;
+    size_t size() const;
+    int compare(Expr, Expr);
+    void collect(const std::vector<Expr*>& roots);
+private:
+    Expr insert(Expr_Type, Atom, const Expr* args, size_t arity, uint64_t count);
+    Expr_Node& at(size_t id) const;
+    void grow_index();
+} Expr_Store;
+
+Expr_Store store;
+
+// Set while worker threads run shapes; interning then takes the mutex.
+// Reading nodes never does.
+bool store_shared = false;
+std::mutex store_mutex;
+
+typedef enum {
+    MATCH_FUN,      // pop a subject; check head and arity, push its args
+    MATCH_BIND,     // pop a subject into slot `arg`
+    MATCH_SAME,     // pop a subject; it must equal slot `arg`
+    MATCH_SUCC,     // pop a subject; strip `arg` successors, push the rest
+    BUILD_SLOT,     // push slot `arg`
+    BUILD_CONST,    // push the ground term with id `arg`
+    BUILD_FUN,      // pop `arg` terms, push head(terms...)
+    BUILD_SUCC,     // pop a term, push it wrapped in `arg` successors
+} Opcode;
+
+typedef struct Instr {
+    Opcode op;
+    Atom head;
+    uint32_t arg;
+} Instr;
+
+typedef enum {
+    Fuel_Left,
+    Fuel_Steps,     // the step budget is spent
+    Fuel_Time,      // the time budget is spent
+    Fuel_Cycle,     // a term came back at the same position
+} Fuel_State;
+
+// Bounds the rewriting of one shape. Every rewrite burns a step and the
+// clock is read every FUEL_CLOCK_STEPS of them; a limit of 0 is no limit.
+// Once out, the rewriters stop rewriting and unwind, leaving the term as it
+// stood. Shared by the forks of a split rewrite.
+#define FUEL_CLOCK_STEPS 1024
+typedef struct Fuel {
+    uint64_t limit;
+    std::chrono::steady_clock::time_point deadline;
+    bool timed;
+    std::atomic<uint64_t> used;
+    std::atomic<int> state;
+    Expr cycle;         // the repeated term, set by whoever stopped on it
+public:
+    void start(uint64_t limit, double seconds);
+    bool out() const;
+    bool burn();
+    void stop(Fuel_State, Expr);
+} Fuel;
+
+// Per-rule counters, filled only by the profiled rewrite paths.
+typedef struct Rule_Stats {
+    uint64_t attempts;
+    uint64_t hits;
+    uint64_t built;     // store nodes created while rewriting
+    double seconds;
+} Rule_Stats;
+
+// Matcher and builder of one rule compiled to C++ by --emit-cpp; same
+// contract as Rule::try_apply.
+typedef bool (*Native_Match)(Expr*);
+
+// Native code linked into this binary, by rule fingerprint. A rule whose
+// fingerprint is listed runs it instead of interpreting its programs.
+std::unordered_map<uint64_t, Native_Match> native_matchers;
+
+// `compile` turns the left side into a matching program over slot indices
+// and the right side into a postfix instantiation program. Bindings are
+// handles into the subject, so matching allocates nothing and
+// instantiation only interns the output nodes.
 typedef struct Rule {
-    Expr* left;
-    Expr* right;
-public:    
+    Expr left;
+    Expr right;
+    std::vector<Instr> matcher;
+    std::vector<Instr> builder;
+    size_t slots;
+    Rule_Stats* stats;  // where profiled runs count this rule, if anywhere
+    uint64_t fingerprint;
+    Native_Match native;
+    // set when the left side mentions a theory symbol; such rules match by
+    // search instead of running `matcher`
+    bool theory;
+    std::unordered_map<Atom, uint32_t> variables;
+    std::unordered_set<uint32_t> ground;    // left-side subterms without variables
+public:
+    void compile();
     void print() const;
+    bool try_apply(Expr*) const;
+    bool build(const std::vector<Expr>& slots, const uint64_t* succs, Expr* out) const;
+    bool matches_succ() const;
     void apply(Expr*) const;
-    void apply_all(Expr*) const;
+    template <bool profiled = false> void apply_all(Expr*, Fuel*) const;
 } Rule;
 
-void Expr::print() const {
-    switch (this->type) {
-        case Sym:
-            std::cout << this->name;
-            break;
-        case Fun:
-            std::cout << this->name << "(";
-            for (size_t i = 0; i < this->args.size(); ++i) {
-                this->args[i].print();
-                if (i != this->args.size() - 1) std::cout << ",";
-            }            
-            std::cout << ")";
-            break;
-        default:
-            std::cerr <<  "Invalid Expr Type" << std::endl;
+// Rules bucketed by the head and arity of their left side, so only rules
+// that can possibly match are tried at a node. A rule whose left side is a
+// bare symbol matches anything and is kept in every bucket. Buckets keep
+// insertion order.
+typedef struct Rule_Index {
+    std::unordered_map<uint64_t, std::vector<const Rule*>> buckets;
+    std::vector<const Rule*> any;
+    uint64_t fingerprint = 0;   // of the rules in the order they were added
+public:
+    void add(const Rule*);
+    void clear();
+    const std::vector<const Rule*>& candidates(Expr) const;
+    bool matches_succ() const;
+    bool try_apply(Expr*) const;
+    template <bool profiled = false> void apply_all(Expr*, Fuel*) const;
+} Rule_Index;
+
+// Rewrites terms to normal form under a rule index. Normal forms are
+// memoized by term id, so after a rewrite only the freshly built part of
+// the result is visited again; subterms carried over from the bindings,
+// and any term normalized earlier, are answered from the memo.
+typedef struct Normalizer {
+    Rule_Index rules;
+    Strategy strategy;
+    std::unordered_map<uint32_t, Expr> normal_forms;
+public:
+    template <bool profiled = false> Expr normalize(Expr, Fuel*);
+} Normalizer;
+
+// Counters for the shape being profiled; rewrites and nodes the rewriter
+// tried rules at.
+typedef struct Shape_Stats {
+    uint64_t rewrites;
+    uint64_t visits;
+} Shape_Stats;
+
+Shape_Stats* shape_stats = NULL;
+
+Atom Symbol_Table::intern(const std::string& name) {
+    std::unique_lock<std::mutex> hold(this->lock, std::defer_lock);
+    if (store_shared) hold.lock();
+    auto atom = this->atoms.find(name);
+    if (atom != this->atoms.end()) return atom->second;
+    Atom id = this->names.size();
+    this->names.push_back(name);
+    this->atoms.emplace(name, id);
+    return id;
+}
+
+const std::string& Symbol_Table::name(Atom atom) const {
+    return this->names[atom];
+}
+
+// Orders atoms by name, which unlike ids is the same in every run.
+int Symbol_Table::compare(Atom a, Atom b) {
+    if (a == b) return 0;
+    std::unique_lock<std::mutex> hold(this->lock, std::defer_lock);
+    if (store_shared) hold.lock();
+    return this->names[a].compare(this->names[b]);
+}
+
+size_t hash_node(Expr_Type type, Atom head, const Expr* args, size_t arity, uint64_t count) {
+    size_t hash = ((size_t)head << 2) ^ type ^ (count * 0xff51afd7ed558ccdULL);
+    for (size_t i = 0; i < arity; ++i)
+        hash ^= args[i].id + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+    // ids are mostly sequential; scramble so the index does not probe runs
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+const Expr* Expr_Args::begin() const {
+    return this->data;
+}
+
+const Expr* Expr_Args::end() const {
+    return this->data + this->count;
+}
+
+size_t Expr_Args::size() const {
+    return this->count;
+}
+
+const Expr& Expr_Args::operator[](size_t i) const {
+    return this->data[i];
+}
+
+Expr* Expr_Arena::alloc(size_t count) {
+    const size_t chunk_size = 1 << 16;
+    if (count == 0) return NULL;
+    if (this->chunks.empty() || this->used + count > this->capacity) {
+        this->capacity = std::max(chunk_size, count);
+        this->chunks.emplace_back(new Expr[this->capacity]);
+        this->used = 0;
+    }
+    Expr* out = this->chunks.back().get() + this->used;
+    this->used += count;
+    return out;
+}
+
+const uint32_t EMPTY_SLOT = UINT32_MAX;
+
+void Expr_Store::grow_index() {
+    std::vector<uint32_t> index(std::max((size_t)1024, this->index.size() * 2), EMPTY_SLOT);
+    size_t mask = index.size() - 1;
+    for (uint32_t id: this->index) {
+        if (id == EMPTY_SLOT) continue;
+        size_t i = this->at(id).hash & mask;
+        while (index[i] != EMPTY_SLOT) i = (i + 1) & mask;
+        index[i] = id;
+    }
+    this->index.swap(index);
+}
+
+Expr Expr_Store::intern(
+    Expr_Type type,
+    Atom head,
+    const Expr* args,
+    size_t arity
+) {
+    if (type == Fun && head == succ_atom && arity == 1) return this->intern_num(1, args[0]);
+    uint8_t flags = (type == Fun)? theory(head): 0;
+    if (flags == 0) return this->insert(type, head, args, arity, 0);
+    thread_local std::vector<Expr> canonical;
+    canonical.clear();
+    for (size_t i = 0; i < arity; ++i) {
+        const Expr_Node& node = this->at(args[i].id);
+        if ((flags & THEORY_ASSOC) && node.type == Fun && node.head == head)
+            canonical.insert(canonical.end(), node.args.begin(), node.args.end());
+        else canonical.push_back(args[i]);
+    }
+    if (flags & THEORY_COMM)
+        std::sort(canonical.begin(), canonical.end(), [this](Expr a, Expr b) { return this->compare(a, b) < 0; });
+    return this->insert(type, head, canonical.data(), canonical.size(), 0);
+}
+
+Expr Expr_Store::intern_num(uint64_t count, Expr base) {
+    if (count == 0) return base;
+    const Expr_Node& node = this->at(base.id);
+    if (node.type == Num) {
+        count += node.count;
+        base = node.args[0];
     }
+    return this->insert(Num, succ_atom, &base, 1, count);
+}
+
+Expr Expr_Store::insert(
+    Expr_Type type,
+    Atom head,
+    const Expr* args,
+    size_t arity,
+    uint64_t count
+) {
+    std::unique_lock<std::mutex> lock(store_mutex, std::defer_lock);
+    if (store_shared) lock.lock();
+    if ((this->count + 1) * 2 > this->index.size()) this->grow_index();
+    uint32_t hash = hash_node(type, head, args, arity, count);
+    size_t mask = this->index.size() - 1;
+    size_t i = hash & mask;
+    for (; this->index[i] != EMPTY_SLOT; i = (i + 1) & mask) {
+        const Expr_Node& node = this->at(this->index[i]);
+        if (node.hash != hash || node.type != type || node.head != head
+            || node.args.size() != arity || node.count != count)
+            continue;
+        bool same = true;
+        for (size_t j = 0; j < arity && same; ++j)
+            same = node.args[j].id == args[j].id;
+        if (same) return (Expr){.id = this->index[i]};
+    }
+    Expr* copy = this->arena.alloc(arity);
+    std::copy(args, args + arity, copy);
+    uint64_t size = (type == Num)? count: 1;
+    for (size_t j = 0; j < arity; ++j) size += this->at(args[j].id).size;
+    uint32_t id = this->count++;
+    std::unique_ptr<Expr_Node[]>& chunk = this->chunks[id >> NODE_CHUNK_BITS];
+    if (!chunk) chunk.reset(new Expr_Node[1 << NODE_CHUNK_BITS]);
+    chunk[id & ((1 << NODE_CHUNK_BITS) - 1)] = (Expr_Node){
+        .type = type, .head = head, .args = (Expr_Args){.data = copy, .count = arity},
+        .count = count, .hash = hash, .size = (uint32_t)std::min(size, (uint64_t)UINT32_MAX)
+    };
+    this->index[i] = id;
+    return (Expr){.id = id};
+}
+
+Expr_Store::Expr_Store():
+    chunks(new std::unique_ptr<Expr_Node[]>[(size_t)1 << (32 - NODE_CHUNK_BITS)]), count(0) {}
+
+Expr_Node& Expr_Store::at(size_t id) const {
+    return this->chunks[id >> NODE_CHUNK_BITS][id & ((1 << NODE_CHUNK_BITS) - 1)];
+}
+
+const Expr_Node& Expr_Store::node(Expr expr) const {
+    return this->at(expr.id);
+}
+
+size_t Expr_Store::size() const {
+    return this->count;
+}
+
+// Structural order on terms: type, head name, successors, arity, then the
+// arguments in turn. Sorting the arguments of commutative symbols by it
+// gives the same canonical term in every run. Pairs still to compare are
+// kept on a stack, so terms may be as deep as memory allows.
+int Expr_Store::compare(Expr a, Expr b) {
+    thread_local std::vector<std::pair<Expr, Expr>> stack;
+    stack.clear();
+    stack.emplace_back(a, b);
+    while (!stack.empty()) {
+        std::pair<Expr, Expr> top = stack.back();
+        stack.pop_back();
+        if (top.first.id == top.second.id) continue;
+        const Expr_Node& x = this->at(top.first.id);
+        const Expr_Node& y = this->at(top.second.id);
+        if (x.type != y.type) return (x.type < y.type)? -1: 1;
+        int order = symbols.compare(x.head, y.head);
+        if (order != 0) return order;
+        if (x.count != y.count) return (x.count < y.count)? -1: 1;
+        if (x.args.size() != y.args.size()) return (x.args.size() < y.args.size())? -1: 1;
+        for (size_t i = x.args.size(); i-- > 0;) stack.emplace_back(x.args[i], y.args[i]);
+    }
+    return 0;
+}
+
+// Drops every term not reachable from `roots` and renumbers the survivors
+// into a fresh store, then frees the old nodes and arena in bulk. Handles
+// other than the roots are invalid afterwards.
+void Expr_Store::collect(const std::vector<Expr*>& roots) {
+    std::vector<bool> live(this->count, false);
+    for (Expr* root: roots) live[root->id] = true;
+    for (size_t id = this->count; id-- > 0;)
+        if (live[id]) for (Expr arg: this->at(id).args) live[arg.id] = true;
+    Expr_Store fresh;
+    std::vector<uint32_t> moved(this->count, EMPTY_SLOT);
+    std::vector<Expr> args;
+    for (size_t id = 0; id < this->count; ++id) {
+        if (!live[id]) continue;
+        const Expr_Node& node = this->at(id);
+        args.clear();
+        for (Expr arg: node.args) args.push_back((Expr){.id = moved[arg.id]});
+        moved[id] = fresh.insert(node.type, node.head, args.data(), args.size(), node.count).id;
+    }
+    for (Expr* root: roots) root->id = moved[root->id];
+    std::swap(*this, fresh);
+}
+
+Expr make_sym(Atom head) {
+    return store.intern(Sym, head, NULL, 0);
+}
+
+Expr make_fun(Atom head, const std::vector<Expr>& args) {
+    return store.intern(Fun, head, args.data(), args.size());
+}
+
+Expr_Type Expr::type() const {
+    return store.node(*this).type;
+}
+
+Atom Expr::head() const {
+    return store.node(*this).head;
+}
+
+const std::string& Expr::name() const {
+    return symbols.name(store.node(*this).head);
+}
+
+// for Num nodes this is the base under the successors, not the predecessor
+Expr_Args Expr::args() const {
+    return store.node(*this).args;
+}
+
+uint64_t Expr::count() const {
+    return store.node(*this).count;
+}
+
+Expr predecessor(Expr expr) {
+    const Expr_Node& node = store.node(expr);
+    return store.intern_num(node.count - 1, node.args[0]);
+}
+
+void Expr::print() const {
+    std::cout << this->tostr();
 }
 
 void print(const std::vector<Expr> exprs) {
@@ -68,125 +530,300 @@ void print(const std::vector<Expr> exprs) {
 }
 
 bool Expr::equal(const Expr* expr) const {
-    if (expr == NULL || this->type != expr->type) return false;
-    switch (this->type) {
-        case Sym: return this->name == expr->name;
-        case Fun:
-            if (this->args.size() != expr->args.size()) return false;
-            for (size_t i = 0; i < this->args.size(); ++i)
-                if (!this->args[i].equal(&expr->args[i])) return false;
-            return this->name == expr->name;
-        default:
-            std::cerr << "Invalid Expr" << std::endl; 
-            return false;         
+    return expr != NULL && this->id == expr->id;
+}
+
+// Appends `expr` as a tree to `out`. Arguments listed in `names` are
+// written as their binding instead of being expanded.
+void write_term(Expr root, std::string* out, const std::unordered_map<uint32_t, size_t>* names) {
+    std::vector<std::pair<Expr, size_t>> stack = {{root, 0}};
+    while (!stack.empty()) {
+        Expr expr = stack.back().first;
+        size_t next = stack.back().second++;
+        const Expr_Node& node = store.node(expr);
+        const std::string& name = symbols.name(node.head);
+        Expr arg;
+        switch (node.type) {
+            case Sym:
+                *out += name;
+                stack.pop_back();
+                continue;
+            case Fun:
+                if (next == 0) {
+                    *out += name;
+                    *out += '(';
+                }
+                if (next == node.args.size()) {
+                    *out += ')';
+                    stack.pop_back();
+                    continue;
+                }
+                if (next > 0) *out += ',';
+                arg = node.args[next];
+                break;
+            case Num:
+                if (next == 1) {
+                    out->append(node.count, ')');
+                    stack.pop_back();
+                    continue;
+                }
+                for (uint64_t i = 0; i < node.count; ++i) {
+                    *out += name;
+                    *out += '(';
+                }
+                arg = node.args[0];
+                break;
+            default:
+                std::cerr <<  "Invalid Expr" << std::endl;
+                stack.pop_back();
+                continue;
+        }
+        if (names != NULL) {
+            auto bound = names->find(arg.id);
+            if (bound != names->end()) {
+                *out += '%';
+                *out += std::to_string(bound->second);
+                continue;
+            }
+        }
+        stack.push_back({arg, 0});
     }
 }
 
 std::string Expr::tostr() const {
-    std::string out = ""; 
-    switch (this->type) {
-        case Sym:
-            out += this->name;
-            break;
-        case Fun:
-            out += this->name + "(";
-            for (size_t i = 0; i < this->args.size(); ++i) {
-                out += this->args[i].tostr();
-                if (i != this->args.size() - 1) out += ",";
-            }            
-            out += ")";
-            break;
-        default:
-            std::cerr <<  "Invalid Expr" << std::endl;
-    }
+    std::string out = "";
+    write_term(*this, &out, NULL);
     return out;
 }
 
-bool Expr::match_helper(
-    const Expr* expr, 
-    std::unordered_map<std::string, Expr>* bindings
-) const {
-    if (!expr) return false;
-    switch (this->type) {
-        case Sym:
-            if (bindings->find(this->name) == bindings->end()) {
-                (*bindings)[this->name] = *expr;
-                return true;
-            }
-            else return (*bindings)[this->name].equal(expr);
-        case Fun:
-            switch (expr->type) {
-                case Sym: return false;
-                case Fun:
-                    if (this->name != expr->name || this->args.size() != expr->args.size()) 
-                        return false;
-                    for (size_t i = 0; i < this->args.size(); ++i)
-                        if (!this->args[i].match_helper(&expr->args[i], bindings)) return false;
-                    return true;
-                default:
-                    std::cerr << "Invalid Expr" << std::endl;
-                    return false;
-            }
-        default:
-            std::cerr << "Invalid Expr" << std::endl;
-            return false;
-    }
-}
-
-void Expr::apply(std::unordered_map<std::string, Expr> bindings) {
-    switch(this->type) {
-        case Sym: 
-            if (bindings.find(this->name) != bindings.end())
-                *this = bindings[this->name];                
-            break;
-        case Fun:
-            for (size_t i = 0; i < this->args.size(); ++i)
-                this->args[i].apply(bindings);
-            break;
-        default:
-            std::cerr << "Invalid Expr" << std::endl;
-    }
-}
-
-Expr Expr::clone() const {
-    Expr new_expr = {.type = this->type, .name = this->name, .args = std::vector<Expr>()};
-    for (Expr arg: this->args)
-        new_expr.args.push_back(arg.clone());
-    return new_expr;
-}
-
-int Expr::value() const {
-    Expr tmp = this->clone();
-    int val = 0;
-    bool flag = true;
-    while (flag) {
-        switch (tmp.type) {
-            case (Sym): {
-                flag = false;
-                break;
-            }
-            case (Fun): {
-                if (tmp.args.size() == 0) flag == false;
-                else tmp = tmp.args[0];
-                ++val;
-                break;
+void Expr::write(std::string* out) const {
+    write_term(*this, out, NULL);
+}
+
+// Appends `expr` with every compound subterm that occurs more than once
+// written once, as `let %k = ...` lines before the term that uses it.
+// Arguments always have smaller ids than their parents, so numbering the
+// shared subterms by id puts each binding after the ones it refers to.
+// Linear in the number of distinct nodes, however large the tree is.
+void Expr::write_shared(std::string* out) const {
+    std::unordered_map<uint32_t, uint32_t> refs = {{this->id, 0}};
+    std::vector<Expr> pending = {*this};
+    while (!pending.empty()) {
+        const Expr_Node& node = store.node(pending.back());
+        pending.pop_back();
+        for (Expr arg: node.args)
+            if (refs[arg.id]++ == 0) pending.push_back(arg);
+    }
+    std::vector<uint32_t> shared;
+    for (auto& ref: refs)
+        if (ref.second > 1 && store.node((Expr){ref.first}).type != Sym) shared.push_back(ref.first);
+    std::sort(shared.begin(), shared.end());
+    std::unordered_map<uint32_t, size_t> names;
+    for (uint32_t id: shared) {
+        size_t name = names.size() + 1;
+        *out += "let %" + std::to_string(name) + " = ";
+        write_term((Expr){id}, out, &names);
+        *out += '\n';
+        names[id] = name;
+    }
+    write_term(*this, out, &names);
+}
+
+uint64_t Expr::value() const {
+    Expr tmp = *this;
+    uint64_t val = 0;
+    while (tmp.type() != Sym && tmp.args().size() > 0) {
+        val += (tmp.type() == Num)? tmp.count(): 1;
+        tmp = tmp.args()[0];
+    }
+    return val;
+}
+
+// Both compilers walk the term with an explicit stack, so rule sides may
+// be as deep as the matcher and builder programs they produce.
+void compile_left(Expr expr, std::unordered_map<Atom, uint32_t>* slots, std::vector<Instr>* out) {
+    std::vector<Expr> stack = {expr};
+    while (!stack.empty()) {
+        Expr top = stack.back();
+        stack.pop_back();
+        const Expr_Node& node = store.node(top);
+        if (node.type == Num) {
+            out->push_back((Instr){.op = MATCH_SUCC, .head = node.head, .arg = (uint32_t)node.count});
+            stack.push_back(node.args[0]);
+            continue;
+        }
+        if (node.type == Fun) {
+            out->push_back((Instr){.op = MATCH_FUN, .head = node.head, .arg = (uint32_t)node.args.size()});
+            for (size_t i = node.args.size(); i-- > 0;) stack.push_back(node.args[i]);
+            continue;
+        }
+        auto slot = slots->find(node.head);
+        if (slot != slots->end()) {
+            out->push_back((Instr){.op = MATCH_SAME, .head = node.head, .arg = slot->second});
+            continue;
+        }
+        uint32_t index = slots->size();
+        slots->emplace(node.head, index);
+        out->push_back((Instr){.op = MATCH_BIND, .head = node.head, .arg = index});
+    }
+}
+
+// A subterm that mentions no variable is built once, as a constant.
+void compile_right(Expr expr, const std::unordered_map<Atom, uint32_t>& slots, std::vector<Instr>* out) {
+    typedef struct Frame {
+        Expr expr;
+        size_t start;   // of its code in `out`
+        size_t next;    // argument to compile next
+        bool variable;
+    } Frame;
+    std::vector<Frame> stack = {(Frame){.expr = expr, .start = out->size(), .next = 0, .variable = false}};
+    while (!stack.empty()) {
+        Frame& top = stack.back();
+        const Expr_Node& node = store.node(top.expr);
+        if (node.type != Sym && top.next < node.args.size()) {
+            Expr arg = node.args[top.next++];
+            stack.push_back((Frame){.expr = arg, .start = out->size(), .next = 0, .variable = false});
+            continue;
+        }
+        Frame done = top;
+        stack.pop_back();
+        if (node.type == Fun) out->push_back((Instr){.op = BUILD_FUN, .head = node.head, .arg = (uint32_t)node.args.size()});
+        else if (node.type == Num) out->push_back((Instr){.op = BUILD_SUCC, .head = node.head, .arg = (uint32_t)node.count});
+        else {
+            auto slot = slots.find(node.head);
+            if (slot != slots.end()) {
+                out->push_back((Instr){.op = BUILD_SLOT, .head = node.head, .arg = slot->second});
+                done.variable = true;
             }
         }
+        if (!done.variable) {
+            out->resize(done.start);
+            out->push_back((Instr){.op = BUILD_CONST, .head = node.head, .arg = done.expr.id});
+        }
+        if (!stack.empty()) stack.back().variable |= done.variable;
     }
-    return val;
 }
 
-std::optional<std::unordered_map<std::string, Expr>> Expr::match(const Expr* expr) const {
-    std::unordered_map<std::string, Expr> bindings;
-    bool match = this->match_helper(expr, &bindings);
-    if (match) return bindings;
-    return {};
+uint64_t fingerprint_mix(uint64_t seed, uint64_t x) {
+    x ^= seed + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+uint64_t name_fingerprint(const std::string& name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (char ch: name) hash = (hash ^ (uint8_t)ch) * 0x100000001b3ULL;
+    return hash;
+}
+
+// Structural hash of a term by symbol names. Ids and node hashes depend on
+// the order terms were interned in; this is the same in every run.
+uint64_t term_fingerprint(Expr expr) {
+    std::unordered_map<uint32_t, uint64_t> done;
+    std::vector<Expr> stack = {expr};
+    while (!stack.empty()) {
+        Expr top = stack.back();
+        if (done.count(top.id)) {
+            stack.pop_back();
+            continue;
+        }
+        const Expr_Node& node = store.node(top);
+        bool ready = true;
+        for (Expr arg: node.args) {
+            if (done.count(arg.id)) continue;
+            stack.push_back(arg);
+            ready = false;
+        }
+        if (!ready) continue;
+        stack.pop_back();
+        uint64_t hash = name_fingerprint(symbols.name(node.head));
+        hash = fingerprint_mix(fingerprint_mix(hash, node.type), node.count);
+        // a declared theory changes what the term matches
+        if (node.type == Fun && theory(node.head) != 0) hash = fingerprint_mix(hash, theory(node.head));
+        for (Expr arg: node.args) hash = fingerprint_mix(hash, done[arg.id]);
+        done[top.id] = hash;
+    }
+    return done[expr.id];
+}
+
+// Reinterns `expr` bottom up, so it is canonical under the running
+// session's theories. `done` maps old ids to new terms across calls.
+Expr canonical_term(Expr expr, std::unordered_map<uint32_t, Expr>* done) {
+    std::vector<Expr> stack = {expr};
+    std::vector<Expr> args;
+    while (!stack.empty()) {
+        Expr top = stack.back();
+        if (done->count(top.id)) {
+            stack.pop_back();
+            continue;
+        }
+        const Expr_Node& node = store.node(top);
+        bool ready = true;
+        for (Expr arg: node.args) {
+            if (done->count(arg.id)) continue;
+            stack.push_back(arg);
+            ready = false;
+        }
+        if (!ready) continue;
+        stack.pop_back();
+        args.clear();
+        for (Expr arg: node.args) args.push_back(done->at(arg.id));
+        Expr out = top;
+        if (node.type == Num) out = store.intern_num(node.count, args[0]);
+        else if (node.type == Fun) out = store.intern(Fun, node.head, args.data(), args.size());
+        done->emplace(top.id, out);
+    }
+    return done->at(expr.id);
+}
+
+bool mentions_theory(Expr expr) {
+    if (theories->flags.empty()) return false;
+    std::unordered_set<uint32_t> seen;
+    std::vector<Expr> stack = {expr};
+    while (!stack.empty()) {
+        const Expr_Node& node = store.node(stack.back());
+        stack.pop_back();
+        if (node.type == Fun && theory(node.head) != 0) return true;
+        for (Expr arg: node.args) if (seen.insert(arg.id).second) stack.push_back(arg);
+    }
+    return false;
+}
+
+void Rule::compile() {
+    std::unordered_map<Atom, uint32_t> slots;
+    this->matcher.clear();
+    this->builder.clear();
+    compile_left(this->left, &slots, &this->matcher);
+    compile_right(this->right, slots, &this->builder);
+    this->slots = slots.size();
+    this->theory = mentions_theory(this->left);
+    this->variables = this->theory? slots: std::unordered_map<Atom, uint32_t>();
+    this->ground.clear();
+    if (this->theory) {
+        // arguments have smaller ids than their terms, so by id is bottom up
+        std::vector<uint32_t> ids = {this->left.id};
+        std::unordered_set<uint32_t> seen = {this->left.id};
+        for (size_t i = 0; i < ids.size(); ++i)
+            for (Expr arg: store.node((Expr){ids[i]}).args) if (seen.insert(arg.id).second) ids.push_back(arg.id);
+        std::sort(ids.begin(), ids.end());
+        for (uint32_t id: ids) {
+            const Expr_Node& node = store.node((Expr){id});
+            bool ground = node.type != Sym;
+            for (Expr arg: node.args) ground = ground && this->ground.count(arg.id) > 0;
+            if (ground) this->ground.insert(id);
+        }
+    }
+    this->fingerprint = fingerprint_mix(term_fingerprint(this->left), term_fingerprint(this->right));
+    auto native = native_matchers.find(this->fingerprint);
+    this->native = (native == native_matchers.end())? NULL: native->second;
 }
 
 void Rule::print() const {
-    this->left->print();
+    this->left.print();
     std::cout << " = ";
-    this->right->print();
+    this->right.print();
 }
 
 void print(const std::vector<Rule> rules) {
@@ -196,31 +833,947 @@ void print(const std::vector<Rule> rules) {
     }
 }
 
+// Matching modulo theories. Both sides are canonical, so the arguments of
+// a commutative symbol are matched as a multiset and those of an
+// associative one as a sequence, where a variable may take a run of
+// arguments standing for one term of the same head. Goals that leave no
+// choice are worked off in a loop; only choices recurse, and a failed one
+// unbinds what it bound through the trail. Patterns that fix a subject go
+// first: bound variables and ground terms, then other terms, then free
+// variables, the most repeated first, as they must take a multiple of each
+// argument. Runs are interned only once a whole match is found. The first
+// match whose result differs from the subject wins; a rewrite to the same
+// term, as `add(x, y) = add(y, x)` does once `add` is commutative, would
+// only loop.
+typedef struct Theory_Goal {
+    bool list;                      // a theory symbol's arguments, else a pair
+    Expr pattern;
+    Expr subject;
+    Atom head;
+    std::vector<Expr> patterns;
+    std::vector<Expr> subjects;     // sorted when `head` is commutative
+} Theory_Goal;
+
+// A variable's value: a term, or a run of arguments of `head`.
+typedef struct Theory_Value {
+    bool bound;
+    Expr term;
+    Atom head;
+    std::vector<Expr> run;
+} Theory_Value;
+
+typedef enum {
+    THEORY_FAIL,    // the goal cannot hold
+    THEORY_NEXT,    // the goal was replaced by the goals it implies
+    THEORY_FOUND,   // a choice led to a whole match
+} Theory_Step;
+
+typedef struct Theory_Match {
+    const Rule* rule;
+    Expr subject;
+    Expr result;
+    std::vector<Theory_Value> values;   // by slot
+    std::vector<uint32_t> trail;        // slots in the order they were bound
+public:
+    bool solve(std::vector<Theory_Goal> goals);
+private:
+    Theory_Value& value(Expr variable);
+    void bind(Expr variable, Expr term);
+    void bind_run(Expr variable, Atom head, std::vector<Expr> run);
+    bool undo(size_t mark);
+    bool holds(const Theory_Value&, Expr subject) const;
+    std::vector<Expr> parts(const Theory_Value&, Atom head) const;
+    bool remove(const Theory_Value&, Atom head, std::vector<Expr>* subjects) const;
+    Theory_Step bag(Theory_Goal& goal, std::vector<Theory_Goal>& goals);
+    Theory_Step sequence(Theory_Goal& goal, std::vector<Theory_Goal>& goals);
+    Theory_Step split(Atom head, Expr variable, size_t times, const std::vector<Expr>& patterns,
+                      const std::vector<std::pair<Expr, size_t>>& counts, size_t at, const std::vector<Theory_Goal>& goals,
+                      std::vector<Expr>* run, std::vector<Expr>* rest);
+    bool finish();
+} Theory_Match;
+
+Theory_Goal theory_pair(Expr pattern, Expr subject) {
+    return (Theory_Goal){.list = false, .pattern = pattern, .subject = subject};
+}
+
+Theory_Goal theory_list(Atom head, std::vector<Expr> patterns, std::vector<Expr> subjects) {
+    return (Theory_Goal){.list = true, .head = head, .patterns = std::move(patterns), .subjects = std::move(subjects)};
+}
+
+Theory_Value& Theory_Match::value(Expr variable) {
+    return this->values[this->rule->variables.at(store.node(variable).head)];
+}
+
+void Theory_Match::bind(Expr variable, Expr term) {
+    uint32_t slot = this->rule->variables.at(store.node(variable).head);
+    this->values[slot].bound = true;
+    this->values[slot].term = term;
+    this->trail.push_back(slot);
+}
+
+void Theory_Match::bind_run(Expr variable, Atom head, std::vector<Expr> run) {
+    if (run.size() == 1) return this->bind(variable, run[0]);
+    uint32_t slot = this->rule->variables.at(store.node(variable).head);
+    this->values[slot].bound = true;
+    this->values[slot].head = head;
+    this->values[slot].run = std::move(run);
+    this->trail.push_back(slot);
+}
+
+// Unbinds back to `mark`; returns false so failures can return it.
+bool Theory_Match::undo(size_t mark) {
+    for (; this->trail.size() > mark; this->trail.pop_back()) {
+        Theory_Value& value = this->values[this->trail.back()];
+        value.bound = false;
+        value.run.clear();
+    }
+    return false;
+}
+
+bool Theory_Match::holds(const Theory_Value& value, Expr subject) const {
+    if (value.run.empty()) return value.term.id == subject.id;
+    const Expr_Node& node = store.node(subject);
+    if (node.type != Fun || node.head != value.head || node.args.size() != value.run.size()) return false;
+    for (size_t i = 0; i < value.run.size(); ++i) if (node.args[i].id != value.run[i].id) return false;
+    return true;
+}
+
+// The arguments of `head` a bound value stands for.
+std::vector<Expr> Theory_Match::parts(const Theory_Value& value, Atom head) const {
+    if (!value.run.empty()) {
+        if (value.head == head) return value.run;
+        return {store.intern(Fun, value.head, value.run.data(), value.run.size())};
+    }
+    const Expr_Node& node = store.node(value.term);
+    if ((theory(head) & THEORY_ASSOC) && node.type == Fun && node.head == head)
+        return std::vector<Expr>(node.args.begin(), node.args.end());
+    return {value.term};
+}
+
+// Takes the arguments a bound value covers out of a multiset of `head`'s.
+bool Theory_Match::remove(const Theory_Value& value, Atom head, std::vector<Expr>* subjects) const {
+    for (Expr part: this->parts(value, head)) {
+        auto at = std::find_if(subjects->begin(), subjects->end(), [part](Expr x) { return x.id == part.id; });
+        if (at == subjects->end()) return false;
+        subjects->erase(at);
+    }
+    return true;
+}
+
+// Tries each run of `variable` that takes a multiple of `times` of every
+// argument in `counts` from `at` on, leaving enough for `patterns`.
+Theory_Step Theory_Match::split(Atom head, Expr variable, size_t times, const std::vector<Expr>& patterns,
+                                const std::vector<std::pair<Expr, size_t>>& counts, size_t at, const std::vector<Theory_Goal>& goals,
+                                std::vector<Expr>* run, std::vector<Expr>* rest) {
+    if (at == counts.size()) {
+        if (run->empty() || rest->size() < patterns.size()) return THEORY_FAIL;
+        size_t mark = this->trail.size();
+        std::vector<Theory_Goal> next = goals;
+        next.push_back(theory_list(head, patterns, *rest));
+        this->bind_run(variable, head, *run);
+        if (this->solve(next)) return THEORY_FOUND;
+        this->undo(mark);
+        return THEORY_FAIL;
+    }
+    Expr arg = counts[at].first;
+    size_t count = counts[at].second;
+    // the largest share first, so the first match takes as much as it can
+    for (size_t share = count / times + 1; share-- > 0;) {
+        size_t run_size = run->size(), rest_size = rest->size();
+        run->insert(run->end(), share, arg);
+        rest->insert(rest->end(), count - share * times, arg);
+        Theory_Step step = this->split(head, variable, times, patterns, counts, at + 1, goals, run, rest);
+        run->resize(run_size);
+        rest->resize(rest_size);
+        if (step == THEORY_FOUND) return step;
+    }
+    return THEORY_FAIL;
+}
+
+// The arguments of a commutative symbol, associative or not.
+Theory_Step Theory_Match::bag(Theory_Goal& goal, std::vector<Theory_Goal>& goals) {
+    bool assoc = theory(goal.head) & THEORY_ASSOC;
+    std::vector<Expr>& subjects = goal.subjects;
+    std::vector<Expr> open;
+    for (Expr pattern: goal.patterns) {
+        const Expr_Node& node = store.node(pattern);
+        if (node.type == Sym) {
+            const Theory_Value& value = this->value(pattern);
+            if (!value.bound) open.push_back(pattern);
+            else if (!this->remove(value, goal.head, &subjects)) return THEORY_FAIL;
+        }
+        else if (this->rule->ground.count(pattern.id) > 0) {
+            auto at = std::find_if(subjects.begin(), subjects.end(), [pattern](Expr x) { return x.id == pattern.id; });
+            if (at == subjects.end()) return THEORY_FAIL;
+            subjects.erase(at);
+        }
+        else open.push_back(pattern);
+    }
+    if (open.empty()) return subjects.empty()? THEORY_NEXT: THEORY_FAIL;
+    if (assoc? subjects.size() < open.size(): subjects.size() != open.size()) return THEORY_FAIL;
+    auto term = std::find_if(open.begin(), open.end(), [](Expr x) { return x.type() != Sym; });
+    if (term != open.end()) {
+        Expr pattern = *term;
+        const Expr_Node& node = store.node(pattern);
+        open.erase(term);
+        for (size_t i = 0; i < subjects.size(); ++i) {
+            if (i > 0 && subjects[i].id == subjects[i - 1].id) continue;
+            const Expr_Node& subject = store.node(subjects[i]);
+            if (subject.type != node.type || (node.type == Fun && subject.head != node.head)
+                || (node.type == Num && subject.count < node.count))
+                continue;
+            std::vector<Expr> rest = subjects;
+            rest.erase(rest.begin() + i);
+            std::vector<Theory_Goal> next = goals;
+            next.push_back(theory_list(goal.head, open, rest));
+            next.push_back(theory_pair(pattern, subjects[i]));
+            if (this->solve(next)) return THEORY_FOUND;
+        }
+        return THEORY_FAIL;
+    }
+    // only free variables are left; the most repeated one goes first
+    Expr variable = open[0];
+    size_t times = 0;
+    for (Expr candidate: open) {
+        size_t count = std::count_if(open.begin(), open.end(), [candidate](Expr x) { return x.id == candidate.id; });
+        if (count > times) times = count, variable = candidate;
+    }
+    open.erase(std::remove_if(open.begin(), open.end(), [variable](Expr x) { return x.id == variable.id; }), open.end());
+    std::vector<std::pair<Expr, size_t>> counts;
+    for (Expr subject: subjects) {
+        if (!counts.empty() && counts.back().first.id == subject.id) ++counts.back().second;
+        else counts.emplace_back(subject, 1);
+    }
+    if (!assoc) {
+        for (size_t i = 0; i < counts.size(); ++i) {
+            if (counts[i].second < times) continue;
+            std::vector<Expr> rest = subjects;
+            auto at = std::find_if(rest.begin(), rest.end(), [&](Expr x) { return x.id == counts[i].first.id; });
+            rest.erase(at, at + times);
+            size_t mark = this->trail.size();
+            std::vector<Theory_Goal> next = goals;
+            next.push_back(theory_list(goal.head, open, rest));
+            this->bind(variable, counts[i].first);
+            if (this->solve(next)) return THEORY_FOUND;
+            this->undo(mark);
+        }
+        return THEORY_FAIL;
+    }
+    std::vector<Expr> run, rest;
+    if (open.empty()) {
+        // the last variable takes everything, evenly
+        for (const std::pair<Expr, size_t>& count: counts) {
+            if (count.second % times != 0) return THEORY_FAIL;
+            run.insert(run.end(), count.second / times, count.first);
+        }
+        this->bind_run(variable, goal.head, run);
+        return THEORY_NEXT;
+    }
+    return this->split(goal.head, variable, times, open, counts, 0, goals, &run, &rest);
+}
+
+// The arguments of an associative symbol that is not commutative.
+Theory_Step Theory_Match::sequence(Theory_Goal& goal, std::vector<Theory_Goal>& goals) {
+    std::vector<Expr>& patterns = goal.patterns;
+    std::vector<Expr>& subjects = goal.subjects;
+    if (patterns.empty()) return subjects.empty()? THEORY_NEXT: THEORY_FAIL;
+    if (subjects.size() < patterns.size()) return THEORY_FAIL;
+    Expr pattern = patterns[0];
+    std::vector<Expr> rest_patterns(patterns.begin() + 1, patterns.end());
+    if (pattern.type() != Sym) {
+        goals.push_back(theory_list(goal.head, rest_patterns, std::vector<Expr>(subjects.begin() + 1, subjects.end())));
+        goals.push_back(theory_pair(pattern, subjects[0]));
+        return THEORY_NEXT;
+    }
+    const Theory_Value& value = this->value(pattern);
+    if (value.bound) {
+        std::vector<Expr> parts = this->parts(value, goal.head);
+        if (parts.size() > subjects.size()) return THEORY_FAIL;
+        for (size_t i = 0; i < parts.size(); ++i) if (parts[i].id != subjects[i].id) return THEORY_FAIL;
+        goals.push_back(theory_list(goal.head, rest_patterns, std::vector<Expr>(subjects.begin() + parts.size(), subjects.end())));
+        return THEORY_NEXT;
+    }
+    if (rest_patterns.empty()) {
+        this->bind_run(pattern, goal.head, subjects);
+        return THEORY_NEXT;
+    }
+    for (size_t count = 1; count + rest_patterns.size() <= subjects.size(); ++count) {
+        size_t mark = this->trail.size();
+        std::vector<Theory_Goal> next = goals;
+        next.push_back(theory_list(goal.head, rest_patterns, std::vector<Expr>(subjects.begin() + count, subjects.end())));
+        this->bind_run(pattern, goal.head, std::vector<Expr>(subjects.begin(), subjects.begin() + count));
+        if (this->solve(next)) return THEORY_FOUND;
+        this->undo(mark);
+    }
+    return THEORY_FAIL;
+}
+
+// Interns the runs and builds the result of a whole match.
+bool Theory_Match::finish() {
+    std::vector<Expr> slots(this->values.size());
+    for (size_t i = 0; i < this->values.size(); ++i) {
+        const Theory_Value& value = this->values[i];
+        slots[i] = value.run.empty()? value.term: store.intern(Fun, value.head, value.run.data(), value.run.size());
+    }
+    if (!this->rule->build(slots, NULL, &this->result)) return false;
+    return this->result.id != this->subject.id;
+}
+
+// False leaves the bindings as they were on entry.
+bool Theory_Match::solve(std::vector<Theory_Goal> goals) {
+    size_t mark = this->trail.size();
+    while (!goals.empty()) {
+        Theory_Goal goal = std::move(goals.back());
+        goals.pop_back();
+        if (goal.list) {
+            Theory_Step step = (theory(goal.head) & THEORY_COMM)? this->bag(goal, goals): this->sequence(goal, goals);
+            if (step == THEORY_FOUND) return true;
+            if (step == THEORY_FAIL) return this->undo(mark);
+            continue;
+        }
+        if (this->rule->ground.count(goal.pattern.id) > 0) {
+            if (goal.pattern.id != goal.subject.id) return this->undo(mark);
+            continue;
+        }
+        const Expr_Node& pattern = store.node(goal.pattern);
+        const Expr_Node& subject = store.node(goal.subject);
+        if (pattern.type == Sym) {
+            const Theory_Value& value = this->value(goal.pattern);
+            if (!value.bound) this->bind(goal.pattern, goal.subject);
+            else if (!this->holds(value, goal.subject)) return this->undo(mark);
+            continue;
+        }
+        if (pattern.type == Num) {
+            if (subject.type != Num || subject.count < pattern.count) return this->undo(mark);
+            goals.push_back(theory_pair(pattern.args[0], store.intern_num(subject.count - pattern.count, subject.args[0])));
+            continue;
+        }
+        if (subject.type != Fun || subject.head != pattern.head) return this->undo(mark);
+        if (theory(pattern.head) != 0) {
+            goals.push_back(theory_list(pattern.head,
+                std::vector<Expr>(pattern.args.begin(), pattern.args.end()),
+                std::vector<Expr>(subject.args.begin(), subject.args.end())));
+            continue;
+        }
+        if (subject.args.size() != pattern.args.size()) return this->undo(mark);
+        for (size_t i = pattern.args.size(); i-- > 0;) goals.push_back(theory_pair(pattern.args[i], subject.args[i]));
+    }
+    return this->finish() || this->undo(mark);
+}
+
+// A matcher subject: `expr` under `succs` successors that are never
+// interned, so a failed match leaves the store as it was.
+typedef struct Match_Term {
+    Expr expr;
+    uint64_t succs;
+} Match_Term;
+
+// Moves the successors of a Num node into `succs`, leaving its base.
+Match_Term unfold_succs(Match_Term term) {
+    const Expr_Node& node = store.node(term.expr);
+    if (node.type != Num) return term;
+    return (Match_Term){.expr = node.args[0], .succs = term.succs + node.count};
+}
+
+bool Rule::try_apply(Expr* expr) const {
+    if (this->native != NULL) return this->native(expr);
+    if (this->theory) {
+        // sides equal modulo the theory never change a term
+        if (this->left.id == this->right.id) return false;
+        Theory_Match match = {.rule = this, .subject = *expr, .result = *expr,
+                              .values = std::vector<Theory_Value>(this->slots, (Theory_Value){.bound = false})};
+        if (!match.solve({theory_pair(this->left, *expr)})) return false;
+        *expr = match.result;
+        return true;
+    }
+    // scratch buffers keep their capacity, so a warm match allocates nothing
+    thread_local std::vector<Match_Term> stack;
+    thread_local std::vector<Expr> slots;
+    thread_local std::vector<uint64_t> succs;
+    if (slots.size() < this->slots) {
+        slots.resize(this->slots);
+        succs.resize(this->slots);
+    }
+    stack.clear();
+    stack.push_back((Match_Term){.expr = *expr, .succs = 0});
+    for (const Instr& instr: this->matcher) {
+        Match_Term subject = stack.back();
+        stack.pop_back();
+        switch (instr.op) {
+            case MATCH_FUN: {
+                if (subject.succs != 0) return false;
+                const Expr_Node& node = store.node(subject.expr);
+                if (node.type != Fun || node.head != instr.head || node.args.size() != instr.arg)
+                    return false;
+                for (size_t i = node.args.size(); i-- > 0;) stack.push_back((Match_Term){.expr = node.args[i], .succs = 0});
+                break;
+            }
+            case MATCH_SUCC: {
+                subject = unfold_succs(subject);
+                if (subject.succs < instr.arg) return false;
+                stack.push_back((Match_Term){.expr = subject.expr, .succs = subject.succs - instr.arg});
+                break;
+            }
+            case MATCH_BIND:
+                slots[instr.arg] = subject.expr;
+                succs[instr.arg] = subject.succs;
+                break;
+            case MATCH_SAME: {
+                Match_Term bound = unfold_succs((Match_Term){.expr = slots[instr.arg], .succs = succs[instr.arg]});
+                subject = unfold_succs(subject);
+                if (bound.expr.id != subject.expr.id || bound.succs != subject.succs) return false;
+                break;
+            }
+            default:
+                std::cerr << "Invalid Instr" << std::endl;
+                return false;
+        }
+    }
+    return this->build(slots, succs.data(), expr);
+}
+
+// Runs the builder over matched slots. Slot `i` stands for `slots[i]` under
+// `succs[i]` more successors (none when `succs` is NULL); those are folded
+// into the successors the builder adds, so a term is interned only where
+// the result holds it.
+bool Rule::build(const std::vector<Expr>& slots, const uint64_t* succs, Expr* out) const {
+    thread_local std::vector<Expr> stack;
+    thread_local std::vector<uint64_t> pending;
+    stack.clear();
+    pending.clear();
+    for (const Instr& instr: this->builder) {
+        switch (instr.op) {
+            case BUILD_SLOT:
+                stack.push_back(slots[instr.arg]);
+                pending.push_back((succs != NULL)? succs[instr.arg]: 0);
+                break;
+            case BUILD_CONST:
+                stack.push_back((Expr){.id = instr.arg});
+                pending.push_back(0);
+                break;
+            case BUILD_FUN: {
+                size_t base = stack.size() - instr.arg;
+                for (size_t i = base; i < stack.size(); ++i) stack[i] = store.intern_num(pending[i], stack[i]);
+                Expr term = store.intern(Fun, instr.head, stack.data() + base, instr.arg);
+                stack.resize(base);
+                pending.resize(base);
+                stack.push_back(term);
+                pending.push_back(0);
+                break;
+            }
+            case BUILD_SUCC:
+                pending.back() += instr.arg;
+                break;
+            default:
+                std::cerr << "Invalid Instr" << std::endl;
+                return false;
+        }
+    }
+    *out = store.intern_num(pending.back(), stack.back());
+    return true;
+}
+
+typedef struct Task {
+    std::function<void()> run;
+    std::atomic<size_t>* pending;   // tasks of the same fork still unfinished
+} Task;
+
+typedef struct Task_Queue {
+    std::mutex lock;
+    std::deque<Task*> tasks;
+} Task_Queue;
+
+// Fork-join pool for splitting a single rewrite across threads. Queue 0
+// takes forks from threads outside the pool; each worker owns one more.
+// Owners pop their newest task, thieves take the oldest one elsewhere. A
+// thread waiting on a join keeps running queued tasks, so nested forks
+// never leave the pool blocked.
+typedef struct Task_Pool {
+    std::vector<std::unique_ptr<Task_Queue>> queues;
+    std::vector<std::thread> threads;
+    std::mutex idle_lock;
+    std::condition_variable idle;
+    size_t queued = 0;
+    bool stopping = false;
+public:
+    void start(size_t workers);
+    bool active() const;
+    void fork_join(const std::vector<std::function<void()>>& jobs);
+    ~Task_Pool();
+private:
+    bool run_one(size_t self);
+    void work(size_t self);
+} Task_Pool;
+
+Task_Pool rewrite_pool;
+thread_local size_t pool_slot = 0;
+
+// Subterms under this many nodes are rewritten on the current thread.
+size_t split_cutoff = 4096;
+// Joins nest on the waiting thread's stack; deeper forks run inline.
+const size_t MAX_FORK_DEPTH = 32;
+thread_local size_t fork_depth = 0;
+
+void Task_Pool::start(size_t workers) {
+    if (!this->threads.empty() || workers < 2) return;
+    store_shared = true;
+    this->queues.emplace_back(new Task_Queue());
+    for (size_t i = 1; i <= workers; ++i) this->queues.emplace_back(new Task_Queue());
+    for (size_t i = 1; i <= workers; ++i) this->threads.emplace_back(&Task_Pool::work, this, i);
+}
+
+bool Task_Pool::active() const {
+    return !this->threads.empty();
+}
+
+bool Task_Pool::run_one(size_t self) {
+    Task* task = NULL;
+    for (size_t k = 0; k < this->queues.size() && task == NULL; ++k) {
+        Task_Queue& queue = *this->queues[(self + k) % this->queues.size()];
+        std::lock_guard<std::mutex> hold(queue.lock);
+        if (queue.tasks.empty()) continue;
+        if (k == 0) {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        } else {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        }
+    }
+    if (task == NULL) return false;
+    {
+        std::lock_guard<std::mutex> hold(this->idle_lock);
+        --this->queued;
+    }
+    std::atomic<size_t>* pending = task->pending;
+    task->run();
+    pending->fetch_sub(1);
+    return true;
+}
+
+void Task_Pool::work(size_t self) {
+    pool_slot = self;
+    for (;;) {
+        if (this->run_one(self)) continue;
+        std::unique_lock<std::mutex> hold(this->idle_lock);
+        this->idle.wait(hold, [&]() { return this->stopping || this->queued > 0; });
+        if (this->stopping) return;
+    }
+}
+
+void Task_Pool::fork_join(const std::vector<std::function<void()>>& jobs) {
+    std::atomic<size_t> pending(jobs.size());
+    std::vector<Task> tasks;
+    for (const auto& job: jobs) tasks.push_back((Task){.run = job, .pending = &pending});
+    {
+        Task_Queue& queue = *this->queues[pool_slot];
+        std::lock_guard<std::mutex> hold(queue.lock);
+        for (Task& task: tasks) queue.tasks.push_back(&task);
+    }
+    {
+        std::lock_guard<std::mutex> hold(this->idle_lock);
+        this->queued += tasks.size();
+    }
+    this->idle.notify_all();
+    while (pending.load() > 0)
+        if (!this->run_one(pool_slot)) std::this_thread::yield();
+}
+
+Task_Pool::~Task_Pool() {
+    {
+        std::lock_guard<std::mutex> hold(this->idle_lock);
+        this->stopping = true;
+    }
+    this->idle.notify_all();
+    for (std::thread& thread: this->threads) thread.join();
+}
+
+void Fuel::start(uint64_t limit, double seconds) {
+    this->limit = limit;
+    this->timed = seconds > 0;
+    if (this->timed) this->deadline = std::chrono::steady_clock::now() +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    this->used = 0;
+    this->state = Fuel_Left;
+}
+
+bool Fuel::out() const {
+    return this->state.load(std::memory_order_relaxed) != Fuel_Left;
+}
+
+// Counts one rewrite; false once the budget is spent.
+bool Fuel::burn() {
+    uint64_t used = this->used.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (this->limit != 0 && used > this->limit) this->stop(Fuel_Steps, (Expr){0});
+    else if (this->timed && used % FUEL_CLOCK_STEPS == 0 && std::chrono::steady_clock::now() > this->deadline)
+        this->stop(Fuel_Time, (Expr){0});
+    return !this->out();
+}
+
+// The first reason to stop wins.
+void Fuel::stop(Fuel_State state, Expr expr) {
+    int left = Fuel_Left;
+    if (this->state.compare_exchange_strong(left, state)) this->cycle = expr;
+}
+
+// Tells whether the terms a position goes through repeat. Terms are
+// hash-consed, so comparing ids is comparing terms; Brent's method keeps
+// one marked term and moves the mark at powers of two, so a cycle is found
+// within twice the steps it takes to close, in constant space.
+typedef struct Cycle_Check {
+    Expr mark;
+    uint64_t power;
+    uint64_t steps;
+public:
+    void start(Expr);
+    bool repeated(Expr);
+} Cycle_Check;
+
+void Cycle_Check::start(Expr expr) {
+    this->mark = expr;
+    this->power = 1;
+    this->steps = 0;
+}
+
+bool Cycle_Check::repeated(Expr expr) {
+    if (expr.equal(&this->mark)) return true;
+    if (++this->steps == this->power) {
+        this->mark = expr;
+        this->power *= 2;
+        this->steps = 0;
+    }
+    return false;
+}
+
+// How many of `args` reach the cutoff, stopping at two: a split only pays
+// when at least two tasks have real work.
+size_t big_args(const Expr* args, size_t arity) {
+    size_t big = 0;
+    for (size_t i = 0; i < arity && big < 2; ++i)
+        if (store.node(args[i]).size >= split_cutoff) ++big;
+    return big;
+}
+
+// Shared driver for every whole-term rewrite. It walks the term with an
+// explicit frame stack, so depth is bounded by memory rather than by the C++
+// stack. Each node goes through rounds: `policy.enter` may rewrite the node,
+// then its arguments are rewritten (staged on a shared scratch stack) and
+// the node rebuilt, then `policy.again` decides whether to start another
+// round at the same node. `policy.cached` answers a node without visiting
+// it and `policy.leave` sees every finished node. The argument of a Num is
+// its predecessor, unless `policy.skip_succ()` says no rule can match an
+// s(...) level, in which case the whole chain is stepped over to its base.
+// Under a `policy.lazy()` rewrite an argument that changes ends the round,
+// so the node is tried again before the arguments after it are touched;
+// those are only rewritten if they are still there and still needed.
+// Rounds that start from a term the node already started from would repeat
+// forever, so the node ends there and `policy.cycle` is told.
+// When `rewrite_pool` runs and at least two of a node's arguments are big,
+// they are all rewritten as separate tasks, each under `policy.fork()`; the forks are
+// handed back to `policy.join` in argument order.
+template <typename Policy>
+Expr rewrite_term(Expr root, Policy& policy) {
+    typedef struct Frame {
+        Expr orig;      // term this frame was entered with
+        Expr start;     // term at the start of the current round
+        Expr expr;
+        size_t base;    // first staged argument in `args`
+        uint32_t arity;
+        uint32_t next;
+        bool changed;
+        bool small;     // under split_cutoff, and so is everything below
+        Cycle_Check rounds; // over the terms each round starts from
+    } Frame;
+    thread_local std::vector<Frame> frames;
+    thread_local std::vector<Expr> args;
+    const bool skip_succ = policy.skip_succ();
+    const bool lazy = policy.lazy();
+    const bool split = rewrite_pool.active() && !lazy;
+    const size_t bottom = frames.size();
+    auto stage = [&](Frame* frame) {
+        const Expr_Node& node = store.node(frame->expr);
+        frame->base = args.size();
+        frame->next = 0;
+        frame->changed = false;
+        switch (node.type) {
+            case Fun:
+                args.insert(args.end(), node.args.begin(), node.args.end());
+                frame->arity = node.args.size();
+                break;
+            case Num:
+                args.push_back(skip_succ? node.args[0]: predecessor(frame->expr));
+                frame->arity = 1;
+                break;
+            default:
+                frame->arity = 0;
+        }
+    };
+    auto enter = [&](Expr expr, Expr* out) {
+        if (policy.cached(expr, out)) return false;
+        Frame frame = {.orig = expr, .start = expr, .expr = expr};
+        frame.rounds.start(expr);
+        frame.small = !split || (frames.size() > bottom && frames.back().small);
+        policy.enter(&frame.expr);
+        stage(&frame);
+        frames.push_back(frame);
+        return true;
+    };
+    Expr result = root;
+    if (!enter(root, &result)) return result;
+    // rewrites every argument of the top frame in parallel; the frame is
+    // looked up again afterwards since helping other tasks may grow `frames`
+    auto fork_args = [&](size_t top) {
+        std::vector<Expr> results(args.begin() + frames[top].base, args.begin() + frames[top].base + frames[top].arity);
+        std::vector<Policy> forks;
+        std::vector<std::function<void()>> jobs;
+        for (size_t i = 0; i < results.size(); ++i) forks.push_back(policy.fork());
+        for (size_t i = 0; i < results.size(); ++i)
+            jobs.push_back([&, i]() { results[i] = rewrite_term(results[i], forks[i]); });
+        ++fork_depth;
+        rewrite_pool.fork_join(jobs);
+        --fork_depth;
+        Frame& frame = frames[top];
+        for (size_t i = 0; i < results.size(); ++i) {
+            policy.join(forks[i]);
+            Expr& slot = args[frame.base + i];
+            frame.changed |= !slot.equal(&results[i]);
+            slot = results[i];
+        }
+        frame.next = frame.arity;
+    };
+    while (frames.size() > bottom) {
+        size_t top = frames.size() - 1;
+        if (!frames[top].small && frames[top].next == 0 && frames[top].arity > 1
+            && fork_depth < MAX_FORK_DEPTH) {
+            size_t big = big_args(args.data() + frames[top].base, frames[top].arity);
+            if (big == 2) {
+                fork_args(top);
+                continue;
+            }
+            frames[top].small = big == 0;
+        }
+        if (frames[top].next < frames[top].arity) {
+            Expr arg = args[frames[top].base + frames[top].next];
+            if (enter(arg, &result)) continue;
+        } else {
+            Frame& frame = frames[top];
+            if (frame.changed) {
+                const Expr_Node& node = store.node(frame.expr);
+                frame.expr = (node.type == Num)?
+                    store.intern_num(skip_succ? node.count: 1, args[frame.base]):
+                    store.intern(Fun, node.head, args.data() + frame.base, frame.arity);
+            }
+            args.resize(frame.base);
+            bool again = policy.again(frame.start, &frame.expr, frame.changed);
+            if (again && frame.rounds.repeated(frame.expr)) {
+                policy.cycle(frame.expr);
+                again = false;
+            }
+            if (again) {
+                frame.start = frame.expr;
+                policy.enter(&frame.expr);
+                stage(&frame);
+                continue;
+            }
+            policy.leave(frame.orig, frame.expr);
+            result = frame.expr;
+            frames.pop_back();
+            if (frames.size() == bottom) break;
+        }
+        Frame& parent = frames.back();
+        Expr& slot = args[parent.base + parent.next++];
+        parent.changed |= !slot.equal(&result);
+        slot = result;
+        if (lazy && parent.changed) parent.next = parent.arity;
+    }
+    return result;
+}
+
+// Every rewrite path is instantiated twice. With `profiled` set, attempts
+// are timed and counted into Rule::stats and `shape_stats`; without it the
+// code is the same as if the counters did not exist.
+template <bool profiled>
+bool try_rule(const Rule* rule, Expr* expr) {
+    if (!profiled) return rule->try_apply(expr);
+    size_t before = store.size();
+    auto start = std::chrono::steady_clock::now();
+    bool hit = rule->try_apply(expr);
+    if (rule->stats != NULL) {
+        rule->stats->seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        rule->stats->attempts += 1;
+        rule->stats->hits += hit;
+        rule->stats->built += store.size() - before;
+    }
+    if (hit && shape_stats != NULL) shape_stats->rewrites += 1;
+    return hit;
+}
+
+template <bool profiled>
+bool try_rules(const Rule* rule, Expr* expr) {
+    return try_rule<profiled>(rule, expr);
+}
+
+template <bool profiled>
+bool try_rules(const Rule_Index* index, Expr* expr) {
+    for (const Rule* rule: index->candidates(*expr))
+        if (try_rule<profiled>(rule, expr)) return true;
+    return false;
+}
+
+// `all`: try the rules once at a node, rewrite its arguments, and go again
+// from the node while that changed anything.
+template <typename Rules, bool profiled>
+struct Apply_All_Policy {
+    const Rules* rules;
+    bool succ;
+    Fuel* fuel;
+public:
+    bool skip_succ() const { return !this->succ; }
+    bool lazy() const { return false; }
+    bool cached(Expr expr, Expr* out) const {
+        *out = expr;
+        return this->fuel->out();
+    }
+    void enter(Expr* expr) const {
+        if (profiled && shape_stats != NULL) shape_stats->visits += 1;
+        if (!this->fuel->out() && try_rules<profiled>(this->rules, expr)) this->fuel->burn();
+    }
+    bool again(Expr start, Expr* expr, bool) const { return !this->fuel->out() && !expr->equal(&start); }
+    void leave(Expr, Expr) const {}
+    void cycle(Expr expr) const { this->fuel->stop(Fuel_Cycle, expr); }
+    Apply_All_Policy fork() const { return *this; }
+    void join(const Apply_All_Policy&) const {}
+};
+
+// `inner` and `outer`, memoized in the normalizer's table. A fork writes
+// its own table and reads its parents', which do not change until it is
+// joined back.
+template <bool profiled>
+struct Normalize_Policy {
+    Normalizer* normalizer;
+    std::unordered_map<uint32_t, Expr>* memo;
+    const Normalize_Policy* parent;
+    std::unique_ptr<std::unordered_map<uint32_t, Expr>> owned;
+    Fuel* fuel;
+public:
+    bool skip_succ() const { return !this->normalizer->rules.matches_succ(); }
+    bool lazy() const { return this->normalizer->strategy == Lazy; }
+    bool cached(Expr expr, Expr* out) const {
+        if (this->fuel->out()) {
+            *out = expr;
+            return true;
+        }
+        for (const Normalize_Policy* policy = this; policy != NULL; policy = policy->parent) {
+            auto memo = policy->memo->find(expr.id);
+            if (memo == policy->memo->end()) continue;
+            *out = memo->second;
+            return true;
+        }
+        return false;
+    }
+    void enter(Expr* expr) const {
+        if (profiled && shape_stats != NULL) shape_stats->visits += 1;
+        if (this->normalizer->strategy == Innermost || this->fuel->out()) return;
+        Cycle_Check check;
+        check.start(*expr);
+        while (try_rules<profiled>(&this->normalizer->rules, expr)) {
+            if (!this->fuel->burn()) return;
+            if (check.repeated(*expr)) {
+                this->cycle(*expr);
+                return;
+            }
+        }
+    }
+    bool again(Expr, Expr* expr, bool changed) const {
+        if (this->fuel->out()) return false;
+        if (this->normalizer->strategy != Innermost) return changed;
+        return try_rules<profiled>(&this->normalizer->rules, expr) && this->fuel->burn();
+    }
+    // a term left when the fuel ran out is not a normal form
+    void leave(Expr orig, Expr out) const {
+        if (this->fuel->out()) return;
+        (*this->memo)[orig.id] = out;
+        (*this->memo)[out.id] = out;
+    }
+    void cycle(Expr expr) const { this->fuel->stop(Fuel_Cycle, expr); }
+    Normalize_Policy fork() const {
+        Normalize_Policy child = {.normalizer = this->normalizer, .parent = this, .fuel = this->fuel};
+        child.owned.reset(new std::unordered_map<uint32_t, Expr>());
+        child.memo = child.owned.get();
+        return child;
+    }
+    void join(const Normalize_Policy& child) const {
+        this->memo->insert(child.memo->begin(), child.memo->end());
+    }
+};
+
 void Rule::apply(Expr* expr) const {
-    auto out = this->left->match(expr);
-    if (!out) {
+    if (!this->try_apply(expr))
         std::cerr << "Rule does not match with the given Expr" << std::endl;
+}
+
+bool Rule::matches_succ() const {
+    return this->left.type() != Fun;
+}
+
+template <bool profiled>
+void Rule::apply_all(Expr* expr, Fuel* fuel) const {
+    Apply_All_Policy<Rule, profiled> policy = {.rules = this, .succ = this->matches_succ(), .fuel = fuel};
+    *expr = rewrite_term(*expr, policy);
+}
+
+// Flattening changes the arity of an associative symbol's terms, so its
+// rules share one bucket whatever the arity.
+uint64_t rule_index_key(Atom head, size_t arity) {
+    if (theory(head) & THEORY_ASSOC) arity = UINT32_MAX;
+    return ((uint64_t)head << 32) | arity;
+}
+
+void Rule_Index::add(const Rule* rule) {
+    this->fingerprint = fingerprint_mix(this->fingerprint, rule->fingerprint);
+    if (rule->left.type() == Sym) {
+        this->any.push_back(rule);
+        for (auto& bucket: this->buckets) bucket.second.push_back(rule);
         return;
     }
-    *expr = this->right->clone();
-    expr->apply(*out);
+    uint64_t key = rule_index_key(rule->left.head(), rule->left.args().size());
+    auto bucket = this->buckets.find(key);
+    if (bucket == this->buckets.end())
+        bucket = this->buckets.emplace(key, this->any).first;
+    bucket->second.push_back(rule);
 }
 
-void Rule::apply_all(Expr* expr) const {
-    auto out = this->left->match(expr);
-    Expr old_expr = expr->clone();
-    if (out) this->apply(expr);
-    for (size_t i = 0; i < expr->args.size(); ++i)
-        this->apply_all(&expr->args[i]);
-    if (!expr->equal(&old_expr)) this->apply_all(expr);
+void Rule_Index::clear() {
+    this->buckets.clear();
+    this->any.clear();
+    this->fingerprint = 0;
 }
 
-void print_bindings(std::unordered_map<std::string, Expr> bindings) {
-    for (auto binding: bindings) {
-        std::cout << binding.first << " => ";
-        binding.second.print();
-        std::cout << std::endl;
-    }
+const std::vector<const Rule*>& Rule_Index::candidates(Expr expr) const {
+    if (expr.type() == Sym) return this->any;
+    auto bucket = this->buckets.find(rule_index_key(expr.head(), expr.args().size()));
+    return (bucket == this->buckets.end())? this->any: bucket->second;
+}
+
+bool Rule_Index::matches_succ() const {
+    auto bucket = this->buckets.find(rule_index_key(succ_atom, 1));
+    return !((bucket == this->buckets.end())? this->any: bucket->second).empty();
+}
+
+bool Rule_Index::try_apply(Expr* expr) const {
+    return try_rules<false>(this, expr);
+}
+
+template <bool profiled>
+void Rule_Index::apply_all(Expr* expr, Fuel* fuel) const {
+    Apply_All_Policy<Rule_Index, profiled> policy = {.rules = this, .succ = this->matches_succ(), .fuel = fuel};
+    *expr = rewrite_term(*expr, policy);
+}
+
+template <bool profiled>
+Expr Normalizer::normalize(Expr expr, Fuel* fuel) {
+    Normalize_Policy<profiled> policy = {.normalizer = this, .memo = &this->normal_forms, .parent = NULL, .fuel = fuel};
+    return rewrite_term(expr, policy);
 }
 
-#endif // SOCK_ENR_CPP_
\ No newline at end of file
+#endif // SOCK_ENR_CPP_
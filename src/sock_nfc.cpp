@@ -0,0 +1,166 @@
+#ifndef SOCK_NFC_CPP_
+#define SOCK_NFC_CPP_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <fstream>
+#include <filesystem>
+#include <unordered_map>
+#include "sock_enr.cpp"
+#include "sock_soqc.cpp"
+
+// Normal-form cache: the result of a whole shape step, keyed by the
+// fingerprint of the rules it ran under, the step's mod and the input term.
+// Redefining a rule changes the fingerprint, so results made under the old
+// rule are never answered again. A file keeps the cache between runs:
+//   "SOQN" u32 version | symbols and terms as in .soqc
+//   u32 entries, each u64 rules, u8 mode, u32 input, u32 output, u32 age
+// `age` counts the saves since an entry was last used; entries older than
+// NFC_MAX_AGE are dropped, which also clears out stale fingerprints.
+
+#define NFC_MAGIC 0x4e514f53u
+#define NFC_VERSION 1u
+#define NFC_MAX_AGE 16u
+// mode of `all` steps; normalizing steps use their Strategy
+#define NFC_ALL 3
+
+typedef struct Nfc_Entry {
+    uint64_t rules;
+    uint8_t mode;
+    Expr input;
+    Expr output;
+    uint32_t age;
+    bool used;
+} Nfc_Entry;
+
+typedef struct Nfc_Key {
+    uint64_t rules;
+    uint32_t input;
+    uint8_t mode;
+public:
+    bool operator==(const Nfc_Key& other) const {
+        return this->rules == other.rules && this->input == other.input && this->mode == other.mode;
+    }
+} Nfc_Key;
+
+struct Nfc_Key_Hash {
+    size_t operator()(const Nfc_Key& key) const {
+        return fingerprint_mix(key.rules, ((uint64_t)key.input << 8) | key.mode);
+    }
+};
+
+// Lookups come from worker threads and server clients, so they lock.
+// `roots` and `reindex` bracket a collection.
+typedef struct Nf_Cache {
+    bool enabled = false;
+    std::string filename;
+    std::vector<Nfc_Entry> entries;
+    std::unordered_map<Nfc_Key, size_t, Nfc_Key_Hash> index;
+    std::mutex lock;
+public:
+    bool find(uint64_t rules, uint8_t mode, Expr input, Expr* output);
+    void insert(uint64_t rules, uint8_t mode, Expr input, Expr output);
+    void roots(std::vector<Expr*>*);
+    void reindex();
+    bool load(const std::string);
+    bool save(const std::string);
+} Nf_Cache;
+
+Nf_Cache nf_cache;
+
+bool Nf_Cache::find(uint64_t rules, uint8_t mode, Expr input, Expr* output) {
+    std::lock_guard<std::mutex> hold(this->lock);
+    auto at = this->index.find((Nfc_Key){rules, input.id, mode});
+    if (at == this->index.end()) return false;
+    Nfc_Entry& entry = this->entries[at->second];
+    entry.used = true;
+    *output = entry.output;
+    return true;
+}
+
+void Nf_Cache::insert(uint64_t rules, uint8_t mode, Expr input, Expr output) {
+    std::lock_guard<std::mutex> hold(this->lock);
+    if (!this->index.emplace((Nfc_Key){rules, input.id, mode}, this->entries.size()).second) return;
+    this->entries.push_back((Nfc_Entry){rules, mode, input, output, 0, true});
+}
+
+void Nf_Cache::roots(std::vector<Expr*>* out) {
+    for (Nfc_Entry& entry: this->entries) {
+        out->push_back(&entry.input);
+        out->push_back(&entry.output);
+    }
+}
+
+void Nf_Cache::reindex() {
+    this->index.clear();
+    for (size_t i = 0; i < this->entries.size(); ++i) {
+        const Nfc_Entry& entry = this->entries[i];
+        this->index.emplace((Nfc_Key){entry.rules, entry.input.id, entry.mode}, i);
+    }
+}
+
+// A missing or unreadable file leaves the cache empty.
+bool Nf_Cache::load(const std::string filename) {
+    Soqc_Reader reader = {std::ifstream(filename, std::ios::binary)};
+    if (reader.in.fail()) return false;
+    uint32_t magic, version, count;
+    if (!reader.u32(&magic) || magic != NFC_MAGIC) return false;
+    if (!reader.u32(&version) || version != NFC_VERSION) return false;
+    std::vector<Expr> terms;
+    if (!soqc_read_terms(&reader, &terms)) return false;
+    std::vector<Nfc_Entry> loaded;
+    if (!reader.u32(&count)) return false;
+    for (uint32_t i = 0; i < count; ++i) {
+        Nfc_Entry entry = {.used = false};
+        uint32_t input, output;
+        if (!reader.u64(&entry.rules) || !reader.u8(&entry.mode)) return false;
+        if (!reader.u32(&input) || input >= terms.size()) return false;
+        if (!reader.u32(&output) || output >= terms.size()) return false;
+        if (!reader.u32(&entry.age)) return false;
+        entry.input = terms[input];
+        entry.output = terms[output];
+        loaded.push_back(entry);
+    }
+    std::lock_guard<std::mutex> hold(this->lock);
+    this->entries = std::move(loaded);
+    this->reindex();
+    return true;
+}
+
+bool Nf_Cache::save(const std::string filename) {
+    std::lock_guard<std::mutex> hold(this->lock);
+    std::vector<Nfc_Entry> kept;
+    std::vector<Expr> roots;
+    for (const Nfc_Entry& entry: this->entries) {
+        uint32_t age = entry.used? 0: entry.age + 1;
+        if (age > NFC_MAX_AGE) continue;
+        kept.push_back(entry);
+        kept.back().age = age;
+        roots.push_back(entry.input);
+        roots.push_back(entry.output);
+    }
+    std::string temp = filename + ".tmp";
+    Soqc_Writer writer = {std::ofstream(temp, std::ios::binary)};
+    if (writer.out.fail()) return false;
+    writer.u32(NFC_MAGIC);
+    writer.u32(NFC_VERSION);
+    std::unordered_map<uint32_t, uint32_t> term_at;
+    soqc_write_terms(&writer, roots, &term_at);
+    writer.u32(kept.size());
+    for (const Nfc_Entry& entry: kept) {
+        writer.u64(entry.rules);
+        writer.u8(entry.mode);
+        writer.u32(term_at[entry.input.id]);
+        writer.u32(term_at[entry.output.id]);
+        writer.u32(entry.age);
+    }
+    writer.out.close();
+    if (writer.out.fail()) return false;
+    std::error_code error;
+    std::filesystem::rename(temp, filename, error);
+    return !error;
+}
+
+#endif // SOCK_NFC_CPP_
@@ -0,0 +1,220 @@
+#ifndef SOCK_SOQC_CPP_
+#define SOCK_SOQC_CPP_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <unordered_map>
+#include "sock_enr.cpp"
+
+// .soqc: the definitions an imported file made, stored next to it so the
+// next run can skip lexing and parsing. Layout (little endian as written):
+//   "SOQC" u32 version | u64 source size | i64 source mtime
+//   u32 symbols, each u32 length + bytes
+//   u32 terms, each u8 type, u32 symbol, u64 count, u32 arity, u32 args...
+//   u32 records, each u8 kind, string name, then string path / u32 left,
+//   u32 right / string text depending on kind
+// Terms are written children first and refer to each other by position.
+
+#define SOQC_MAGIC 0x43514f53u
+#define SOQC_VERSION 1u
+
+typedef enum {
+    SOQC_IMPORT,    // `name` is the path as written in the import
+    SOQC_RULE,
+    SOQC_MACRO,
+} Soqc_Kind;
+
+typedef struct Soqc_Record {
+    Soqc_Kind kind;
+    std::string name;
+    Expr left;
+    Expr right;
+    std::string text;
+} Soqc_Record;
+
+// Identifies the version of the source a .soqc was compiled from.
+typedef struct Soqc_Stamp {
+    uint64_t size;
+    int64_t mtime;
+} Soqc_Stamp;
+
+bool soqc_stamp(const std::string filename, Soqc_Stamp* stamp) {
+    std::error_code error;
+    std::filesystem::path path(filename);
+    stamp->size = std::filesystem::file_size(path, error);
+    if (error) return false;
+    stamp->mtime = std::filesystem::last_write_time(path, error).time_since_epoch().count();
+    return !error;
+}
+
+typedef struct Soqc_Writer {
+    std::ofstream out;
+public:
+    void u8(uint8_t x) { this->out.put((char)x); }
+    void u32(uint32_t x) { this->out.write((const char*)&x, sizeof x); }
+    void u64(uint64_t x) { this->out.write((const char*)&x, sizeof x); }
+    void str(const std::string& x) {
+        this->u32(x.size());
+        this->out.write(x.data(), x.size());
+    }
+} Soqc_Writer;
+
+typedef struct Soqc_Reader {
+    std::ifstream in;
+public:
+    bool u8(uint8_t* x) { return (bool)this->in.read((char*)x, sizeof *x); }
+    bool u32(uint32_t* x) { return (bool)this->in.read((char*)x, sizeof *x); }
+    bool u64(uint64_t* x) { return (bool)this->in.read((char*)x, sizeof *x); }
+    bool str(std::string* x) {
+        uint32_t size;
+        if (!this->u32(&size)) return false;
+        x->resize(size);
+        return (bool)this->in.read(x->data(), size);
+    }
+} Soqc_Reader;
+
+// Writes the symbols and terms reachable from `pending`, children first,
+// and fills `term_at` with the position of each term.
+void soqc_write_terms(Soqc_Writer* writer, std::vector<Expr> pending, std::unordered_map<uint32_t, uint32_t>* term_at_out) {
+    // store ids already order a node after its arguments
+    std::vector<uint32_t> ids;
+    std::unordered_map<uint32_t, uint32_t>& term_at = *term_at_out;
+    std::unordered_map<Atom, uint32_t> symbol_at;
+    std::vector<Atom> atoms;
+    while (!pending.empty()) {
+        Expr expr = pending.back();
+        pending.pop_back();
+        if (!term_at.emplace(expr.id, 0).second) continue;
+        ids.push_back(expr.id);
+        for (Expr arg: store.node(expr).args) pending.push_back(arg);
+    }
+    std::sort(ids.begin(), ids.end());
+    for (size_t i = 0; i < ids.size(); ++i) {
+        term_at[ids[i]] = i;
+        Atom head = store.node((Expr){ids[i]}).head;
+        if (symbol_at.emplace(head, atoms.size()).second) atoms.push_back(head);
+    }
+    writer->u32(atoms.size());
+    for (Atom atom: atoms) writer->str(symbols.name(atom));
+    writer->u32(ids.size());
+    for (uint32_t id: ids) {
+        const Expr_Node& node = store.node((Expr){id});
+        writer->u8(node.type);
+        writer->u32(symbol_at[node.head]);
+        writer->u64(node.count);
+        writer->u32(node.args.size());
+        for (Expr arg: node.args) writer->u32(term_at[arg.id]);
+    }
+}
+
+// Reads what soqc_write_terms wrote, interning every term.
+bool soqc_read_terms(Soqc_Reader* reader, std::vector<Expr>* terms) {
+    uint32_t count;
+    std::vector<Atom> atoms;
+    if (!reader->u32(&count)) return false;
+    for (uint32_t i = 0; i < count; ++i) {
+        std::string name;
+        if (!reader->str(&name)) return false;
+        atoms.push_back(symbols.intern(name));
+    }
+    std::vector<Expr> args;
+    if (!reader->u32(&count)) return false;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint8_t type;
+        uint32_t symbol, arity;
+        uint64_t succs;
+        if (!reader->u8(&type) || type > Num) return false;
+        if (!reader->u32(&symbol) || symbol >= atoms.size()) return false;
+        if (!reader->u64(&succs) || !reader->u32(&arity)) return false;
+        args.clear();
+        for (uint32_t j = 0; j < arity; ++j) {
+            uint32_t arg;
+            if (!reader->u32(&arg) || arg >= terms->size()) return false;
+            args.push_back((*terms)[arg]);
+        }
+        if (type == Num) {
+            if (arity != 1) return false;
+            terms->push_back(store.intern_num(succs, args[0]));
+        }
+        else terms->push_back(store.intern((Expr_Type)type, atoms[symbol], args.data(), arity));
+    }
+    return true;
+}
+
+bool soqc_write(const std::string filename, const Soqc_Stamp stamp, const std::vector<Soqc_Record>& records) {
+    std::vector<Expr> roots;
+    for (const Soqc_Record& record: records) {
+        if (record.kind != SOQC_RULE) continue;
+        roots.push_back(record.left);
+        roots.push_back(record.right);
+    }
+    std::string temp = filename + ".tmp";
+    Soqc_Writer writer = {std::ofstream(temp, std::ios::binary)};
+    if (writer.out.fail()) return false;
+    writer.u32(SOQC_MAGIC);
+    writer.u32(SOQC_VERSION);
+    writer.u64(stamp.size);
+    writer.u64(stamp.mtime);
+    std::unordered_map<uint32_t, uint32_t> term_at;
+    soqc_write_terms(&writer, roots, &term_at);
+    writer.u32(records.size());
+    for (const Soqc_Record& record: records) {
+        writer.u8(record.kind);
+        writer.str(record.name);
+        if (record.kind == SOQC_RULE) {
+            writer.u32(term_at[record.left.id]);
+            writer.u32(term_at[record.right.id]);
+        }
+        else if (record.kind == SOQC_MACRO) writer.str(record.text);
+    }
+    writer.out.close();
+    if (writer.out.fail()) {
+        std::remove(temp.c_str());
+        return false;
+    }
+    // rename so a concurrent run never reads a half-written file
+    std::error_code error;
+    std::filesystem::rename(temp, filename, error);
+    return !error;
+}
+
+// Fills `records` from `filename` if it was compiled from a source with
+// the given stamp. Any mismatch or corruption reads as a miss.
+bool soqc_read(const std::string filename, const Soqc_Stamp stamp, std::vector<Soqc_Record>* records) {
+    Soqc_Reader reader = {std::ifstream(filename, std::ios::binary)};
+    if (reader.in.fail()) return false;
+    uint32_t magic, version, count;
+    uint64_t size, mtime;
+    if (!reader.u32(&magic) || magic != SOQC_MAGIC) return false;
+    if (!reader.u32(&version) || version != SOQC_VERSION) return false;
+    if (!reader.u64(&size) || size != stamp.size) return false;
+    if (!reader.u64(&mtime) || (int64_t)mtime != stamp.mtime) return false;
+
+    std::vector<Expr> terms;
+    if (!soqc_read_terms(&reader, &terms)) return false;
+    std::vector<Soqc_Record> loaded;
+    if (!reader.u32(&count)) return false;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint8_t kind;
+        Soqc_Record record;
+        if (!reader.u8(&kind) || kind > SOQC_MACRO) return false;
+        record.kind = (Soqc_Kind)kind;
+        if (!reader.str(&record.name)) return false;
+        if (record.kind == SOQC_RULE) {
+            uint32_t left, right;
+            if (!reader.u32(&left) || left >= terms.size()) return false;
+            if (!reader.u32(&right) || right >= terms.size()) return false;
+            record.left = terms[left];
+            record.right = terms[right];
+        }
+        else if (record.kind == SOQC_MACRO && !reader.str(&record.text)) return false;
+        loaded.push_back(record);
+    }
+    records->swap(loaded);
+    return true;
+}
+
+#endif // SOCK_SOQC_CPP_